@@ -0,0 +1,53 @@
+// Hashing throughput across string lengths, for hash_string() against the
+// byte-at-a-time 32-bit FNV-1a it replaced:
+//   g++ -O2 -std=c++17 -o hash bench/hash.cpp && ./hash
+#include "../src/hash.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+static uint32_t fnv1a(const char* chars, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; ++i)
+	{
+		hash ^= chars[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+static double now()
+{
+	timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+// Hashes the strings at every offset of buf, so that reads are unaligned
+// as often as not; returns nanoseconds per hash:
+template <typename Hash>
+static double time_hash(Hash hash, const char* buf, size_t len, uint64_t* sink)
+{
+	auto rounds = (size_t)(64 << 20) / (len + 16) + 1;
+	auto start = now();
+	for (size_t i = 0; i < rounds; ++i)
+	{
+		*sink += hash(buf + i % 16, len);
+	}
+	return (now() - start) / rounds * 1e9;
+}
+int main()
+{
+	static char buf[4096 + 16];
+	for (size_t i = 0; i < sizeof(buf); ++i)
+	{
+		buf[i] = (char)rand();
+	}
+	uint64_t sink = 0;
+	printf("%6s %12s %10s %12s %10s\n", "len", "fnv1a ns", "GB/s", "hash ns", "GB/s");
+	for (size_t len = 1; len <= 4096; len *= 2)
+	{
+		auto fnv  = time_hash(fnv1a, buf, len, &sink);
+		auto wide = time_hash(hash_string, buf, len, &sink);
+		printf("%6zu %12.2f %10.2f %12.2f %10.2f\n", len, fnv, len / fnv, wide, len / wide);
+	}
+	return sink == 42;
+}
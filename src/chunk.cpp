@@ -8,6 +8,10 @@ void init_Chunk(Chunk* chunk)
 	chunk->len  = 0;
 	chunk->cap  = 0;
 	chunk->code = NULL;
+	chunk->num_words = 0;
+	chunk->words     = NULL;
+	chunk->num_caches = 0;
+	chunk->caches     = NULL;
 	init_ValueArray(&chunk->consts);
 }
 void write_Chunk(Chunk* chunk, uint8_t code)
@@ -21,10 +25,393 @@ void write_Chunk(Chunk* chunk, uint8_t code)
 	chunk->code[chunk->len] = code;
 	++chunk->len;
 }
+
+typedef enum
+{
+	OPERAND_NONE,
+	OPERAND_ULEB,    // One ULEB128 operand.
+	OPERAND_JUMP,    // Four bytes, relative to the end of the operand.
+	OPERAND_GOTO,    // Four bytes, absolute.
+	OPERAND_CLOSURE, // ULEB constant, then a flag byte and ULEB per upvalue.
+	OPERAND_PAIR,    // Two ULEB128 operands.
+	OPERAND_CASE,    // ULEB constant, then a relative jump.
+} OperandType;
+static OperandType operand_type(uint8_t op)
+{
+	switch (op)
+	{
+		case OP_CONST:
+		case OP_DEF_VAR:
+		case OP_SET_VAR:
+		case OP_GET_VAR:
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_GET_UPVAL:
+		case OP_SET_UPVAL:
+		case OP_CALL:
+		case OP_POPN:
+		case OP_BUILD_STRING:
+		case OP_NEW_MAP:
+		case OP_EXTEND_MAP:
+		case OP_SUB_GET:
+		case OP_SUB_SET:
+			return OPERAND_ULEB;
+		case OP_JMP:
+		case OP_OR:
+		case OP_AND:
+		case OP_COAL:
+		case OP_OPTIONAL:
+		case OP_JUMP_IF_FALSE_POP:
+			return OPERAND_JUMP;
+		case OP_GOTO:
+			return OPERAND_GOTO;
+		case OP_CLOSURE:
+			return OPERAND_CLOSURE;
+		case OP_ADD_LL:
+		case OP_ADD_LK:
+		case OP_SUB_LK:
+		case OP_LT_LK:
+		case OP_LE_LK:
+		case OP_GT_LK:
+		case OP_GE_LK:
+		case OP_ADD_LL_INT:
+		case OP_ADD_LK_INT:
+		case OP_SUB_LK_INT:
+		case OP_LT_LK_INT:
+		case OP_LE_LK_INT:
+		case OP_GT_LK_INT:
+		case OP_GE_LK_INT:
+			return OPERAND_PAIR;
+		case OP_CASE_K:
+			return OPERAND_CASE;
+		default:
+			return OPERAND_NONE;
+	}
+}
+static uint64_t read_uleb(Chunk* chunk, long* i)
+{
+	uint64_t result = 0;
+	uint8_t shift = 0;
+	for (;;)
+	{
+		uint8_t val = chunk->code[(*i)++];
+		result |= (uint64_t)(val & 0x7F) << shift;
+		if ((val & 0x80) == 0)
+		{
+			return result;
+		}
+		shift += 7;
+	}
+}
+static uint32_t read_uint(Chunk* chunk, long* i)
+{
+	auto code = chunk->code + *i;
+	*i += 4;
+	return
+		((uint32_t)code[0] << 24) |
+		((uint32_t)code[1] << 16) |
+		((uint32_t)code[2] <<  8) |
+		((uint32_t)code[3]);
+}
+// Reads the instruction at `*i`, moving past it. If `out` is not NULL the
+// decoded words are written there, with jump targets translated through
+// `offsets`; either way the number of words it takes is returned.
+static long decode_inst(Chunk* chunk, long* i, Word* out, long* offsets)
+{
+	auto inst = *i;
+	auto op = chunk->code[(*i)++];
+	long len = 1;
+	if (out != NULL) *out++ = op;
+	switch (operand_type(op))
+	{
+		case OPERAND_NONE:
+			break;
+		case OPERAND_ULEB:
+		case OPERAND_PAIR:
+		{
+			auto operand = read_uleb(chunk, i);
+			if (out != NULL) *out++ = (Word)operand;
+			++len;
+			if (operand_type(op) == OPERAND_PAIR)
+			{
+				operand = read_uleb(chunk, i);
+				if (out != NULL) *out = (Word)operand;
+				++len;
+			}
+			break;
+		}
+		case OPERAND_JUMP:
+		case OPERAND_GOTO:
+		case OPERAND_CASE:
+		{
+			if (operand_type(op) == OPERAND_CASE)
+			{
+				auto operand = read_uleb(chunk, i);
+				if (out != NULL) *out++ = (Word)operand;
+				++len;
+			}
+			long target = read_uint(chunk, i);
+			if (operand_type(op) != OPERAND_GOTO)
+			{
+				target += *i;
+			}
+			++len;
+			// Every kind becomes an offset from the end of the instruction, so
+			// the VM never needs the base of the stream:
+			if (out != NULL) *out = (Word)(offsets[target] - (offsets[inst] + len));
+			break;
+		}
+		case OPERAND_CLOSURE:
+		{
+			auto index = read_uleb(chunk, i);
+			auto func = AS_FUNC(chunk->consts.values[index]);
+			if (out != NULL) *out++ = (Word)index;
+			len += 1 + 2 * func->num_upvalues;
+			for (uint64_t j = 0; j < func->num_upvalues; ++j)
+			{
+				auto is_local = chunk->code[(*i)++];
+				auto upval = read_uleb(chunk, i);
+				if (out != NULL)
+				{
+					*out++ = is_local;
+					*out++ = (Word)upval;
+				}
+			}
+			break;
+		}
+	}
+	return len;
+}
+void decode_Chunk(Chunk* chunk)
+{
+	// Word offset of each instruction, indexed by its byte offset:
+	auto offsets = ALLOCATE(long, chunk->len + 1);
+	long num_words = 0;
+	for (long i = 0; i < chunk->len;)
+	{
+		offsets[i] = num_words;
+		num_words += decode_inst(chunk, &i, NULL, NULL);
+	}
+	offsets[chunk->len] = num_words;
+
+	chunk->words     = ALLOCATE(Word, num_words);
+	chunk->num_words = num_words;
+	for (long i = 0; i < chunk->len;)
+	{
+		auto at = offsets[i];
+		decode_inst(chunk, &i, chunk->words + at, offsets);
+	}
+	FREE_ARRAY(long, offsets, chunk->len + 1);
+
+	chunk->caches = ALLOCATE(PropCache, chunk->num_caches);
+	for (int i = 0; i < chunk->num_caches; ++i)
+	{
+		init_cache(&chunk->caches[i]);
+	}
+}
+
+// Number of words the decoded instruction at `inst` takes.
+static long inst_len(Chunk* chunk, Word* inst)
+{
+	switch (operand_type(inst[0]))
+	{
+		case OPERAND_NONE:
+			return 1;
+		case OPERAND_ULEB:
+		case OPERAND_JUMP:
+		case OPERAND_GOTO:
+			return 2;
+		case OPERAND_PAIR:
+		case OPERAND_CASE:
+			return 3;
+		case OPERAND_CLOSURE:
+			return 2 + 2 * AS_FUNC(chunk->consts.values[inst[1]])->num_upvalues;
+	}
+	return 1;
+}
+// Index of the word the decoded instruction at `at` may jump to, or -1.
+static long jump_target(Chunk* chunk, long at)
+{
+	auto inst = chunk->words + at;
+	switch (operand_type(inst[0]))
+	{
+		case OPERAND_JUMP:
+		case OPERAND_GOTO:
+		case OPERAND_CASE:
+		{
+			auto len = inst_len(chunk, inst);
+			return at + len + inst[len - 1];
+		}
+		default:
+			return -1;
+	}
+}
+static Opcode fused_lk(Word op)
+{
+	switch (op)
+	{
+		case OP_ADD: return OP_ADD_LK;
+		case OP_SUB: return OP_SUB_LK;
+		case OP_LT:  return OP_LT_LK;
+		case OP_LE:  return OP_LE_LK;
+		case OP_GT:  return OP_GT_LK;
+		case OP_GE:  return OP_GE_LK;
+		default:     return OP_CONST; // Not fusable.
+	}
+}
+void fuse_Chunk(Chunk* chunk)
+{
+	auto words = chunk->words;
+	auto len   = chunk->num_words;
+
+	// Where each instruction starts, in order:
+	auto starts = ALLOCATE(long, len + 1);
+	long num_insts = 0;
+	for (long i = 0; i < len; i += inst_len(chunk, words + i))
+	{
+		starts[num_insts++] = i;
+	}
+	starts[num_insts] = len;
+
+	// An instruction something jumps to can't be folded into the one before
+	// it. JUMP_IF_FALSE_POP lands just past the POP its AND jumped to, so
+	// that spot counts as a target too:
+	auto targets = ALLOCATE(bool, len + 1);
+	for (long i = 0; i <= len; ++i)
+	{
+		targets[i] = false;
+	}
+	for (long k = 0; k < num_insts; ++k)
+	{
+		auto target = jump_target(chunk, starts[k]);
+		if (target == -1)
+		{
+			continue;
+		}
+		targets[target] = true;
+		if (words[starts[k]] == OP_AND && target < len && words[target] == OP_POP)
+		{
+			targets[target + 1] = true;
+		}
+	}
+
+	#define OP_AT(k) \
+		((k) < num_insts ? words[starts[k]] : -1)
+	#define OPERAND_AT(k, n) \
+		(words[starts[k] + 1 + (n)])
+	#define FOLDABLE(k) \
+		((k) < num_insts && !targets[starts[k]])
+
+	// Fusing never makes code longer, so `len` words is enough:
+	auto out = ALLOCATE(Word, len);
+	auto moved = ALLOCATE(long, len + 1);
+	// Jump operands in `out`, to be pointed at their targets' new homes:
+	auto fixups  = ALLOCATE(long, num_insts);
+	auto fix_to  = ALLOCATE(long, num_insts);
+	long num_fixups = 0;
+	long n = 0;
+	for (long k = 0; k < num_insts;)
+	{
+		auto at = starts[k];
+		moved[at] = n;
+		auto op = OP_AT(k);
+		if (
+			op == OP_GET_LOCAL &&
+			OP_AT(k + 1) == OP_GET_LOCAL && FOLDABLE(k + 1) &&
+			OP_AT(k + 2) == OP_ADD       && FOLDABLE(k + 2))
+		{
+			out[n++] = OP_ADD_LL;
+			out[n++] = OPERAND_AT(k, 0);
+			out[n++] = OPERAND_AT(k + 1, 0);
+			k += 3;
+		}
+		else if (
+			op == OP_GET_LOCAL &&
+			OP_AT(k + 1) == OP_CONST && FOLDABLE(k + 1) &&
+			FOLDABLE(k + 2) && fused_lk(OP_AT(k + 2)) != OP_CONST)
+		{
+			out[n++] = fused_lk(OP_AT(k + 2));
+			out[n++] = OPERAND_AT(k, 0);
+			out[n++] = OPERAND_AT(k + 1, 0);
+			k += 3;
+		}
+		else if (
+			op == OP_DUP &&
+			OP_AT(k + 1) == OP_CONST && FOLDABLE(k + 1) &&
+			OP_AT(k + 2) == OP_EQUIV && FOLDABLE(k + 2) &&
+			OP_AT(k + 3) == OP_OR    && FOLDABLE(k + 3))
+		{
+			out[n++] = OP_CASE_K;
+			out[n++] = OPERAND_AT(k + 1, 0);
+			fixups[num_fixups] = n;
+			fix_to[num_fixups++] = jump_target(chunk, starts[k + 3]);
+			++n;
+			k += 4;
+		}
+		else if (
+			op == OP_POP &&
+			OP_AT(k + 1) == OP_POP && FOLDABLE(k + 1))
+		{
+			long count = 0;
+			while (OP_AT(k) == OP_POP && (count == 0 || FOLDABLE(k)))
+			{
+				++count;
+				++k;
+			}
+			out[n++] = OP_POPN;
+			out[n++] = count;
+		}
+		else if (
+			op == OP_AND &&
+			jump_target(chunk, at) < len &&
+			words[jump_target(chunk, at)] == OP_POP)
+		{
+			out[n++] = OP_JUMP_IF_FALSE_POP;
+			fixups[num_fixups] = n;
+			fix_to[num_fixups++] = jump_target(chunk, at) + 1;
+			++n;
+			++k;
+		}
+		else
+		{
+			auto size = inst_len(chunk, words + at);
+			for (long i = 0; i < size; ++i)
+			{
+				out[n++] = words[at + i];
+			}
+			if (jump_target(chunk, at) != -1)
+			{
+				fixups[num_fixups] = n - 1;
+				fix_to[num_fixups++] = jump_target(chunk, at);
+			}
+			++k;
+		}
+	}
+	moved[len] = n;
+	#undef OP_AT
+	#undef OPERAND_AT
+	#undef FOLDABLE
+
+	// Every jump operand is the last word of its instruction:
+	for (long i = 0; i < num_fixups; ++i)
+	{
+		out[fixups[i]] = (Word)(moved[fix_to[i]] - (fixups[i] + 1));
+	}
+
+	FREE_ARRAY(Word, chunk->words, chunk->num_words);
+	chunk->words     = GROW_ARRAY(Word, out, len, n);
+	chunk->num_words = n;
+	FREE_ARRAY(long, starts, len + 1);
+	FREE_ARRAY(bool, targets, len + 1);
+	FREE_ARRAY(long, moved, len + 1);
+	FREE_ARRAY(long, fixups, num_insts);
+	FREE_ARRAY(long, fix_to, num_insts);
+}
 void free_Chunk(Chunk* chunk)
 {
 	FREE_ARRAY(uint8_t, chunk->code, chunk->cap);
+	FREE_ARRAY(Word, chunk->words, chunk->num_words);
+	FREE_ARRAY(PropCache, chunk->caches, chunk->num_caches);
 	free_ValueArray(&chunk->consts);
 	init_Chunk(chunk);
 }
-
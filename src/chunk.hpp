@@ -19,13 +19,25 @@ typedef enum
 	#include "opcode.txt"
 	#undef OP
 } Opcode;
+// One slot of the decoded instruction stream: an opcode, or one of its
+// operands, already expanded from ULEB/big-endian form.
+typedef int32_t Word;
 typedef struct
 {
 	long len, cap;
 	uint8_t* code;
 	ValueArray consts;
+	// Fixed-width form the VM runs, built from `code` by decode_Chunk:
+	long  num_words;
+	Word* words;
+	// An inline cache for each map access site, numbered by the compiler
+	// and made along with `words`:
+	int num_caches;
+	struct PropCache* caches;
 } Chunk;
 void init_Chunk(Chunk*  chunk);
 void write_Chunk(Chunk* chunk, uint8_t code);
+void decode_Chunk(Chunk* chunk);
+void fuse_Chunk(Chunk* chunk);
 void free_Chunk(Chunk*  chunk);
 #endif
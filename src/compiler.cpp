@@ -2,6 +2,7 @@
 #include "value.hpp"
 #include "chunk.hpp"
 #include "parser.hpp"
+#include "memory.hpp"
 #include <stdlib.h>
 #include <vector>
 using namespace Node;
@@ -13,10 +14,20 @@ Compiler::Compiler(Parser* parser, VM* vm)
 	this->max_slots  = 0;
 	this->vm = vm;
 	this->curr_scope = NULL;
+	vm->compiler = this;
 }
 Compiler::~Compiler()
 {
 	//free_Chunk(this->chunk());
+	this->vm->compiler = NULL;
+}
+void Compiler::mark_roots()
+{
+	for (auto scope = this->curr_scope; scope != NULL; scope = scope->parent)
+	{
+		mark_obj((Obj*)scope->function);
+	}
+	this->parser->mark_roots();
 }
 
 Chunk* Compiler::chunk()
@@ -277,14 +288,36 @@ void Compiler::emit_uleb(uint64_t code)
 void Compiler::add_const(Value value)
 {
 	push_ValueArray(&this->chunk()->consts, value);
+	WRITE_BARRIER(this->vm, (Obj*)this->curr_scope->function, value);
 	this->emit_uleb(this->chunk()->consts.len - 1);
 }
+void Compiler::emit_global(Opcode op, Token* name)
+{
+	auto str = copy_string(this->vm, name->start, name->length);
+	auto slot = this->vm->global_slot(str);
+	this->emit_op(op);
+	this->emit_uleb(slot);
+}
 void Compiler::emit_const(Value value)
 {
 	push_ValueArray(&this->chunk()->consts, value);
+	WRITE_BARRIER(this->vm, (Obj*)this->curr_scope->function, value);
 	this->emit_op(OP_CONST);
 	this->emit_uleb(this->chunk()->consts.len - 1);
 }
+// Counts a part of an interpolated string about to go on the stack; a
+// full batch is joined first, into the first part of the next:
+void Compiler::add_part(uint64_t* parts)
+{
+	if (*parts == STRING_BATCH)
+	{
+		this->emit_op(OP_BUILD_STRING);
+		this->emit_uleb(*parts);
+		this->mod_stack(1 - STRING_BATCH);
+		*parts = 1;
+	}
+	++*parts;
+}
 void Compiler::visit_binary(Binary* node, Opcode op)
 {
 	this->visit(node->left);
@@ -350,22 +383,28 @@ void Compiler::visit(Base* node)
 		}
 		case NODE_INTERP:
 		{
+			// Every part goes on the stack, leaving out empty chars, and
+			// BUILD_STRING joins them all at once, or STRING_BATCH at a time:
 			auto interps = (StringInterp*)node;
-			auto first = true;
+			uint64_t parts = 0;
 			for (auto interp = interps->list.begin(); interp != interps->list.end(); ++interp)
 			{
-				this->emit_const((*interp)->chars.value);
-				this->visit((*interp)->value);
-				this->emit(OP_TO_STR);
-				this->emit(OP_CONCAT);
-				if (!first)
+				if (AS_STRING((*interp)->chars.value)->len > 0)
 				{
-					this->emit(OP_CONCAT);
+					this->add_part(&parts);
+					this->emit_const((*interp)->chars.value);
 				}
-				else first = false;
+				this->add_part(&parts);
+				this->visit((*interp)->value);
 			}
-			this->emit_const(interps->cap.value);
-			this->emit(OP_CONCAT);
+			if (AS_STRING(interps->cap.value)->len > 0)
+			{
+				this->add_part(&parts);
+				this->emit_const(interps->cap.value);
+			}
+			this->emit_op(OP_BUILD_STRING);
+			this->emit_uleb(parts);
+			this->mod_stack(1 - (int)parts);
 			break;
 		}
 		case NODE_COMP:
@@ -458,8 +497,7 @@ void Compiler::visit(Base* node)
 				auto name = &(*dec)->name;
 				if (this->curr_scope->depth == 0)
 				{
-					this->emit_op(OP_DEF_VAR);
-					this->add_const(OBJ_VAL((Obj*)copy_string(vm, name->start, name->length)));
+					this->emit_global(OP_DEF_VAR, name);
 				}
 				else
 				{
@@ -498,14 +536,23 @@ void Compiler::visit(Base* node)
 			}
 			else
 			{
-				this->emit_op(OP_GET_VAR);
-				this->add_const(OBJ_VAL((Obj*)copy_string(vm, name->start, name->length)));
+				this->emit_global(OP_GET_VAR, name);
 			}
 			break;
 		}
 		case NODE_SET:
 		{
 			auto set = (Set*)node;
+			if (set->left->type == NODE_SUBSCRIPT)
+			{
+				auto sub = (Subscript*)set->left;
+				this->visit(sub->map);
+				this->visit(sub->key);
+				this->visit(set->right);
+				this->emit_op(OP_SUB_SET);
+				this->emit_uleb(this->chunk()->num_caches++);
+				break;
+			}
 			auto name = &((Get*)set->left)->name;
 			auto right = set->right;
 			this->visit(right);
@@ -522,11 +569,43 @@ void Compiler::visit(Base* node)
 			}
 			else
 			{
-				this->emit_op(OP_SET_VAR);
-				this->add_const(OBJ_VAL((Obj*)copy_string(vm, name->start, name->length)));
+				this->emit_global(OP_SET_VAR, name);
 			}
 			break;
 		}
+		case NODE_MAP:
+		{
+			// The pairs go on the stack in order, and NEW_MAP makes the map
+			// with room for them all before it puts them in. Past MAP_BATCH
+			// pairs, the rest follow in batches that EXTEND_MAP adds to it:
+			auto map = (MapLit*)node;
+			size_t len = map->keys.size();
+			size_t start = 0;
+			do
+			{
+				auto end = start + MAP_BATCH < len ? start + MAP_BATCH : len;
+				for (auto i = start; i < end; ++i)
+				{
+					this->visit(map->keys[i]);
+					this->visit(map->values[i]);
+				}
+				this->emit_op(start == 0 ? OP_NEW_MAP : OP_EXTEND_MAP);
+				this->emit_uleb(end - start);
+				this->mod_stack((start == 0 ? 1 : 0) - 2 * (int)(end - start));
+				start = end;
+			}
+			while (start < len);
+			break;
+		}
+		case NODE_SUBSCRIPT:
+		{
+			auto sub = (Subscript*)node;
+			this->visit(sub->map);
+			this->visit(sub->key);
+			this->emit_op(OP_SUB_GET);
+			this->emit_uleb(this->chunk()->num_caches++);
+			break;
+		}
 		case NODE_BLOCK:
 		{
 			auto block = (Block*)node;
@@ -569,8 +648,11 @@ void Compiler::visit(Base* node)
 			this->visit(func->body);
 			auto result = this->end_scope();
 			result->arity = func->args.size();
+			// No longer reachable through the scope chain:
+			this->vm->push(OBJ_VAL((Obj*)result));
 			this->emit_op(OP_CLOSURE);
 			this->add_const(OBJ_VAL((Obj*)result));
+			this->vm->pop();
 			for (auto i = 0; i < result->num_upvalues; ++i)
 			{
 				this->emit(scope.upvalues[i].is_local ? 1 : 0);
@@ -680,6 +762,7 @@ Function* Compiler::compile()
 		}
 		this->visit(node);
 		destroy(node);
+		this->parser->release_literals();
 	}
 	auto result = this->end_scope();
 	return result;
@@ -6,6 +6,10 @@
 #include "node.hpp"
 #include "parser.hpp"
 #include "vm.hpp"
+// A map literal puts at most this many pairs on the stack at once, and
+// an interpolated string this many parts:
+#define MAP_BATCH    32
+#define STRING_BATCH 64
 
 typedef enum
 {
@@ -78,6 +82,8 @@ private:
 	void emit_uleb(uint64_t code);
 	void add_const(Value value);
 	void emit_const(Value value);
+	void emit_global(Opcode op, Token* name);
+	void add_part(uint64_t* parts);
 	void visit_binary(Node::Binary* node, Opcode op);
 	void visit_unary(Node::Unary* node, Opcode op);
 	void visit(Node::Base* node);
@@ -85,6 +91,7 @@ private:
 public:
 	Compiler(Parser* parser, VM* vm);
 	Function* compile();
+	void mark_roots();
 	~Compiler();
 };
 #endif
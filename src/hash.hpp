@@ -0,0 +1,103 @@
+#ifndef hash_header
+#define hash_header
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+// A 64-bit string hash in the manner of wyhash: eight bytes at a time,
+// each pair of words folded together through a full 64x64-bit multiply.
+// It lives apart so that bench/hash.cpp can time it on its own.
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+#define HASH_P3 0x589965cc75374cc3ull
+// Multiplies a by b, leaving the low half of the product in a and the high
+// half in b:
+static inline void hash_mum(uint64_t* a, uint64_t* b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t product = (__uint128_t)*a * *b;
+	*a = (uint64_t)product;
+	*b = (uint64_t)(product >> 64);
+#else
+	uint64_t ha = *a >> 32, la = (uint32_t)*a;
+	uint64_t hb = *b >> 32, lb = (uint32_t)*b;
+	uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+	uint64_t mid = (ll >> 32) + (uint32_t)hl + (uint32_t)lh;
+	*a = (mid << 32) | (uint32_t)ll;
+	*b = hh + (hl >> 32) + (lh >> 32) + (mid >> 32);
+#endif
+}
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+	hash_mum(&a, &b);
+	return a ^ b;
+}
+static inline uint64_t hash_read8(const uint8_t* p)
+{
+	uint64_t word;
+	memcpy(&word, p, 8);
+	return word;
+}
+static inline uint64_t hash_read4(const uint8_t* p)
+{
+	uint32_t word;
+	memcpy(&word, p, 4);
+	return word;
+}
+static inline uint64_t hash_string(const char* chars, size_t len)
+{
+	auto p = (const uint8_t*)chars;
+	uint64_t seed = hash_mix(HASH_P0, HASH_P1);
+	uint64_t a, b;
+	if (len <= 16)
+	{
+		// Up to two overlapping reads from each end cover all of it:
+		if (len >= 4)
+		{
+			auto skip = (len >> 3) << 2;
+			a = (hash_read4(p) << 32) | hash_read4(p + skip);
+			b = (hash_read4(p + len - 4) << 32) | hash_read4(p + len - 4 - skip);
+		}
+		else if (len > 0)
+		{
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+			b = 0;
+		}
+		else
+		{
+			a = b = 0;
+		}
+	}
+	else
+	{
+		auto left = len;
+		if (left > 48)
+		{
+			// Three independent lanes, so that the multiplies overlap:
+			auto lane1 = seed, lane2 = seed;
+			do
+			{
+				seed  = hash_mix(hash_read8(p)      ^ HASH_P1, hash_read8(p + 8)  ^ seed);
+				lane1 = hash_mix(hash_read8(p + 16) ^ HASH_P2, hash_read8(p + 24) ^ lane1);
+				lane2 = hash_mix(hash_read8(p + 32) ^ HASH_P3, hash_read8(p + 40) ^ lane2);
+				p    += 48;
+				left -= 48;
+			} while (left > 48);
+			seed ^= lane1 ^ lane2;
+		}
+		while (left > 16)
+		{
+			seed  = hash_mix(hash_read8(p) ^ HASH_P1, hash_read8(p + 8) ^ seed);
+			p    += 16;
+			left -= 16;
+		}
+		// The last 16 bytes, overlapping what came before if need be:
+		a = hash_read8(p + left - 16);
+		b = hash_read8(p + left - 8);
+	}
+	a ^= HASH_P1;
+	b ^= seed;
+	hash_mum(&a, &b);
+	return hash_mix(a ^ HASH_P0 ^ len, b ^ HASH_P1);
+}
+#endif
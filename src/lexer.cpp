@@ -33,6 +33,7 @@ Lexer::Lexer(const char* str, Lang lang)
 	this->line  = 1;
 	this->col   = 0;
 	this->lang  = lang;
+	this->interp_count = 0;
 }
 bool Lexer::fin()
 {
@@ -523,7 +524,7 @@ Token Lexer::scan(VM* vm)
 		case ')':
 			return this->new_token(TOKEN_RPAREN);
 		case '[':
-			return this->new_token(TOKEN_LBRACE);
+			return this->new_token(TOKEN_LBRACK);
 		case ']':
 			return this->new_token(TOKEN_RBRACK);
 		case '{':
@@ -545,6 +546,16 @@ Token Lexer::scan(VM* vm)
 			return this->new_token(TOKEN_RBRACE);
 		case ':':
 			return this->new_token(TOKEN_COLON);
+		case '.':
+			if (this->match('.'))
+			{
+				if (this->match('.'))
+				{
+					return this->new_token(TOKEN_DOTDOTDOT);
+				}
+				return this->new_token(TOKEN_DOTDOT);
+			}
+			return this->new_token(TOKEN_DOT);
 		case ',':
 			return this->new_token(TOKEN_COMMA);
 		case '"':
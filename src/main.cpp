@@ -9,6 +9,7 @@
 #include "chunk.hpp"
 #include "node.hpp"
 #include "vm.hpp"
+#include "memory.hpp"
 #include "langs.hpp"
 /*Lexer lexer(
 	"match 30 {"
@@ -35,11 +36,20 @@ uint64_t readULEB(int* i, uint8_t* ops)
 }
 uint32_t readUint32(int* i, uint8_t* ops)
 {
+	auto code = ops + *i;
+	*i += 4;
 	return (
-		(ops[(*i)++] << 24) |
-		(ops[(*i)++] << 16) |
-		(ops[(*i)++] << 8)  |
-		(ops[(*i)++]));
+		((uint32_t)code[0] << 24) |
+		((uint32_t)code[1] << 16) |
+		((uint32_t)code[2] << 8)  |
+		((uint32_t)code[3]));
+}
+// Superinstructions and the like that take two ULEB operands:
+void dis_pair(const char* name, int* i, uint8_t* ops)
+{
+	auto a = readULEB(i, ops);
+	auto b = readULEB(i, ops);
+	printf("%s [%lX] [%lX]\n", name, a, b);
 }
 void dis(Chunk* chunk, int indent);
 void dis_obj(Value val, int indent)
@@ -60,7 +70,7 @@ void dis_obj(Value val, int indent)
 }
 void dis_val(Value val, int indent)
 {
-	switch (val.type)
+	switch (VALUE_TYPE(val))
 	{
 		case VALUE_INT:
 			printf("%ld", AS_INT(val));
@@ -77,6 +87,9 @@ void dis_val(Value val, int indent)
 		case VALUE_NULL:
 			printf("%s", "null");
 			break;
+		case VALUE_UNDEFINED:
+			printf("%s", "undefined");
+			break;
 	}
 }
 void dis(Chunk* chunk, int indent)
@@ -133,6 +146,9 @@ void dis(Chunk* chunk, int indent)
 			case OP_CONCAT:
 				printf("CONCAT\n");
 				break;
+			case OP_BUILD_STRING:
+				printf("BUILD STRING [%lX]\n", readULEB(&i, chunk->code));
+				break;
 			case OP_ADD:
 				printf("ADD\n");
 				break;
@@ -148,6 +164,9 @@ void dis(Chunk* chunk, int indent)
 			case OP_MOD:
 				printf("MOD\n");
 				break;
+			case OP_EXP:
+				printf("EXP\n");
+				break;
 			case OP_LSHIFT:
 				printf("LSHIFT\n");
 				break;
@@ -181,6 +200,63 @@ void dis(Chunk* chunk, int indent)
 			case OP_NOT_EQUIV:
 				printf("NOT EQUIV\n");
 				break;
+			case OP_ADD_INT:
+				printf("ADD INT\n");
+				break;
+			case OP_SUB_INT:
+				printf("SUB INT\n");
+				break;
+			case OP_MUL_INT:
+				printf("MUL INT\n");
+				break;
+			case OP_DIV_INT:
+				printf("DIV INT\n");
+				break;
+			case OP_LT_INT:
+				printf("LT INT\n");
+				break;
+			case OP_GT_INT:
+				printf("GT INT\n");
+				break;
+			case OP_LE_INT:
+				printf("LE INT\n");
+				break;
+			case OP_GE_INT:
+				printf("GE INT\n");
+				break;
+			case OP_I_ADD:
+				printf("INPLACE ADD\n");
+				break;
+			case OP_I_SUB:
+				printf("INPLACE SUB\n");
+				break;
+			case OP_I_MUL:
+				printf("INPLACE MUL\n");
+				break;
+			case OP_I_MOD:
+				printf("INPLACE MOD\n");
+				break;
+			case OP_I_DIV:
+				printf("INPLACE DIV\n");
+				break;
+			case OP_I_EXP:
+				printf("INPLACE EXP\n");
+				break;
+			case OP_I_LSHIFT:
+				printf("INPLACE LSHIFT\n");
+				break;
+			case OP_I_RSHIFT:
+				printf("INPLACE RSHIFT\n");
+				break;
+			case OP_I_BOR:
+				printf("INPLACE BOR\n");
+				break;
+			case OP_I_BAND:
+				printf("INPLACE BAND\n");
+				break;
+			case OP_I_XOR:
+				printf("INPLACE XOR\n");
+				break;
 			case OP_CONST:
 			{
 				int64_t index = readULEB(&i, chunk->code);
@@ -202,20 +278,17 @@ void dis(Chunk* chunk, int indent)
 			}
 			case OP_DEF_VAR:
 			{
-				int64_t index = readULEB(&i, chunk->code);
-				auto val = chunk->consts.values[index];
-				printf("DEF VAR ");
-				dis_val(val, indent);
-				printf(" [%lx]\n", index);
+				printf("DEF VAR [%lX]\n", readULEB(&i, chunk->code));
+				break;
+			}
+			case OP_SET_VAR:
+			{
+				printf("SET VAR [%lX]\n", readULEB(&i, chunk->code));
 				break;
 			}
 			case OP_GET_VAR:
 			{
-				int64_t index = readULEB(&i, chunk->code);
-				auto val = chunk->consts.values[index];
-				printf("GET VAR ");
-				dis_val(val, indent);
-				printf(" [%lx]\n", index);
+				printf("GET VAR [%lX]\n", readULEB(&i, chunk->code));
 				break;
 			}
 			case OP_GET_LOCAL:
@@ -260,7 +333,8 @@ void dis(Chunk* chunk, int indent)
 				printf("} [");
 				for (j = 0; j < AS_FUNC(val)->num_upvalues; ++j)
 				{
-					printf("{ %s, %lu }", chunk->code[i++] ? "true" : "false", readULEB(&i, chunk->code));
+					auto is_local = chunk->code[i++];
+					printf("{ %s, %lu }", is_local ? "true" : "false", readULEB(&i, chunk->code));
 					if (j < AS_FUNC(val)->num_upvalues - 1)
 					{
 						printf(", ");
@@ -273,22 +347,27 @@ void dis(Chunk* chunk, int indent)
 			{
 				printf("CALL [%lX]\n", readULEB(&i, chunk->code));
 				break;
-			}/*
+			}
 			case OP_SUB_GET:
 			{
-				printf("SUBSCRIPT\n");
+				printf("SUBSCRIPT <%lX>\n", readULEB(&i, chunk->code));
 				break;
 			}
 			case OP_SUB_SET:
 			{
-				printf("SET SUBSCRIPT\n");
+				printf("SET SUBSCRIPT <%lX>\n", readULEB(&i, chunk->code));
 				break;
 			}
-			case OP_ARRAY:
+			case OP_NEW_MAP:
 			{
-				printf("GEN ARRAY [%lX]\n", readULEB(&i, chunk->code));
+				printf("GEN MAP [%lX]\n", readULEB(&i, chunk->code));
 				break;
-			}*/
+			}
+			case OP_EXTEND_MAP:
+			{
+				printf("EXTEND MAP [%lX]\n", readULEB(&i, chunk->code));
+				break;
+			}
 			case OP_JMP:
 			{
 				uint32_t start = i - 1;
@@ -316,9 +395,85 @@ void dis(Chunk* chunk, int indent)
 				printf("OR %X - %X\n", start, i + end);
 				break;
 			}
-			/*case OP_GOTO:
+			case OP_GOTO:
 				printf("GOTO %X\n", readUint32(&i, chunk->code));
-				break;*/
+				break;
+			case OP_COAL:
+			{
+				uint32_t start = i - 1;
+				uint32_t end  = readUint32(&i, chunk->code);
+				printf("COAL %X - %X\n", start, i + end);
+				break;
+			}
+			case OP_OPTIONAL:
+			{
+				uint32_t start = i - 1;
+				uint32_t end  = readUint32(&i, chunk->code);
+				printf("OPTIONAL %X - %X\n", start, i + end);
+				break;
+			}
+			case OP_JUMP_IF_FALSE_POP:
+			{
+				uint32_t start = i - 1;
+				uint32_t end  = readUint32(&i, chunk->code);
+				printf("JUMP IF FALSE POP %X - %X\n", start, i + end);
+				break;
+			}
+			case OP_CASE_K:
+			{
+				uint32_t start = i - 1;
+				auto index = readULEB(&i, chunk->code);
+				uint32_t end  = readUint32(&i, chunk->code);
+				printf("CASE [%lX] := ", index);
+				dis_val(chunk->consts.values[index], indent);
+				printf(" %X - %X\n", start, i + end);
+				break;
+			}
+			case OP_POPN:
+				printf("POPN [%lX]\n", readULEB(&i, chunk->code));
+				break;
+			case OP_ADD_LL:
+				dis_pair("ADD LL", &i, chunk->code);
+				break;
+			case OP_ADD_LK:
+				dis_pair("ADD LK", &i, chunk->code);
+				break;
+			case OP_SUB_LK:
+				dis_pair("SUB LK", &i, chunk->code);
+				break;
+			case OP_LT_LK:
+				dis_pair("LT LK", &i, chunk->code);
+				break;
+			case OP_LE_LK:
+				dis_pair("LE LK", &i, chunk->code);
+				break;
+			case OP_GT_LK:
+				dis_pair("GT LK", &i, chunk->code);
+				break;
+			case OP_GE_LK:
+				dis_pair("GE LK", &i, chunk->code);
+				break;
+			case OP_ADD_LL_INT:
+				dis_pair("ADD LL INT", &i, chunk->code);
+				break;
+			case OP_ADD_LK_INT:
+				dis_pair("ADD LK INT", &i, chunk->code);
+				break;
+			case OP_SUB_LK_INT:
+				dis_pair("SUB LK INT", &i, chunk->code);
+				break;
+			case OP_LT_LK_INT:
+				dis_pair("LT LK INT", &i, chunk->code);
+				break;
+			case OP_LE_LK_INT:
+				dis_pair("LE LK INT", &i, chunk->code);
+				break;
+			case OP_GT_LK_INT:
+				dis_pair("GT LK INT", &i, chunk->code);
+				break;
+			case OP_GE_LK_INT:
+				dis_pair("GE LK INT", &i, chunk->code);
+				break;
 			case OP_RET:
 				printf("RETURN\n");
 				break;
@@ -350,8 +505,36 @@ int main(int argc, char *argv[])
 		puts("argument needed.");
 		exit(1);
 	}
-	auto program = open_file(argv[1]);
+	auto program = open_file(argv[argc - 1]);
 	VM vm;
+	bool gc_stats = false;
+	for (int i = 1; i < argc - 1; ++i)
+	{
+		if (strcmp(argv[i], "--no-fuse") == 0)
+		{
+			vm.fuse = false;
+		}
+		else if (strncmp(argv[i], "--gc-growth=", 12) == 0)
+		{
+			vm.gc_growth = atof(argv[i] + 12);
+		}
+		else if (strncmp(argv[i], "--gc-budget=", 12) == 0)
+		{
+			vm.gc_budget = atoi(argv[i] + 12);
+		}
+		else if (strcmp(argv[i], "--gc-concurrent") == 0)
+		{
+			vm.gc_concurrent = true;
+		}
+		else if (strcmp(argv[i], "--gc-verify") == 0)
+		{
+			vm.gc_verify = true;
+		}
+		else if (strcmp(argv[i], "--gc-stats") == 0)
+		{
+			gc_stats = true;
+		}
+	}
 	Lexer lexer(program, EN);
 	Parser parser(&lexer, &vm, EN);
 	Compiler compiler(&parser, &vm);
@@ -363,6 +546,10 @@ int main(int argc, char *argv[])
 	vm.call_val(OBJ_VAL(closure), 0);
 	dis(&func->chunk, 0);
 	vm.run();
+	if (gc_stats)
+	{
+		print_gc_stats(&vm);
+	}
 	free(program);
 	return 0;
 }	
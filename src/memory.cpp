@@ -1,14 +1,38 @@
 #include "memory.hpp"
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
 #include "vm.hpp"
 #include "value.hpp"
-void* reallocate(void* ptr, size_t old, size_t next)
+#include "compiler.hpp"
+// The VM whose heap reallocate() collects; set while one is alive:
+static VM* bound_vm = NULL;
+void bind_vm(VM* vm)
+{
+	bound_vm = vm;
+}
+static void maybe_collect(VM* vm);
+static void sweep_slice(VM* vm, int work);
+// Charges a change in heap size to vm, collecting first if one is due:
+static void charge(VM* vm, size_t old, size_t next)
 {
+	vm->bytes_allocated += next - old;
 	if (next > old)
 	{
-		#ifdef STRESS_GC
-		collect();
-		#endif
+		vm->gc_debt += next - old;
+		if (vm->bytes_allocated > vm->peak_heap)
+		{
+			vm->peak_heap = vm->bytes_allocated;
+		}
+		maybe_collect(vm);
+	}
+}
+void* reallocate(void* ptr, size_t old, size_t next)
+{
+	if (bound_vm != NULL)
+	{
+		charge(bound_vm, old, next);
 	}
 	if (next == 0)
 	{
@@ -22,61 +46,590 @@ void* reallocate(void* ptr, size_t old, size_t next)
 	}
 	return result;
 }
-static void free_obj(Obj* object)
+#define FINE_CLASSES (POOL_FINE / POOL_GRAIN)
+#define POOL_CLASS(size) ((size) <= POOL_FINE \
+	? ((size) + POOL_GRAIN - 1) / POOL_GRAIN - 1 \
+	: FINE_CLASSES + ((size) - POOL_FINE + POOL_COARSE - 1) / POOL_COARSE - 1)
+#define CLASS_SIZE(size_class) ((size_class) < FINE_CLASSES \
+	? ((size_class) + 1) * POOL_GRAIN \
+	: POOL_FINE + ((size_class) - FINE_CLASSES + 1) * POOL_COARSE)
+#define PAGE_BASE(ptr) ((char*)((uintptr_t)(ptr) & ~(uintptr_t)(POOL_PAGE - 1)))
+#define PAGE_OF(ptr)   (*(PoolPage**)PAGE_BASE(ptr))
+#define GRAIN_OF(ptr, base) (((char*)(ptr) - (base)) / POOL_GRAIN)
+#define BIT(grain) (1ull << (grain) % 64)
+void init_pool(Pool* pool)
+{
+	for (int i = 0; i < POOL_CLASSES; ++i)
+	{
+		pool->free[i] = NULL;
+	}
+	pool->pages = NULL;
+}
+static PoolPage* new_page(Pool* pool, size_t bytes)
+{
+	auto page = (PoolPage*)calloc(1, sizeof(PoolPage));
+	auto base = (char*)aligned_alloc(POOL_PAGE, bytes);
+	if (page == NULL || base == NULL)
+	{
+		exit(1);
+	}
+	*(PoolPage**)base = page;
+	page->base = base;
+	page->next = pool->pages;
+	if (pool->pages != NULL)
+	{
+		pool->pages->prev = page;
+	}
+	pool->pages = page;
+	return page;
+}
+static void release_page(Pool* pool, PoolPage* page)
+{
+	if (page->prev != NULL)
+	{
+		page->prev->next = page->next;
+	}
+	else
+	{
+		pool->pages = page->next;
+	}
+	if (page->next != NULL)
+	{
+		page->next->prev = page->prev;
+	}
+	free(page->base);
+	free(page);
+}
+// Carves a fresh page into slots of one class:
+static void fill_class(Pool* pool, int size_class)
+{
+	auto page = new_page(pool, POOL_PAGE);
+	auto slot_size = CLASS_SIZE(size_class);
+	auto slot = page->base + POOL_GRAIN;
+	auto end  = page->base + POOL_PAGE;
+	for (; slot + slot_size <= end; slot += slot_size)
+	{
+		auto free_slot = (FreeSlot*)slot;
+		free_slot->next = pool->free[size_class];
+		pool->free[size_class] = free_slot;
+	}
+}
+// Takes a slot of one class; with a sweep pending, a batch of it runs
+// before a fresh page is carved:
+static void* take_slot(VM* vm, int size_class)
+{
+	auto pool = &vm->pool;
+	if (pool->free[size_class] == NULL && vm->gc_phase == GC_SWEEP)
+	{
+		sweep_slice(vm, LAZY_SWEEP);
+	}
+	if (pool->free[size_class] == NULL)
+	{
+		fill_class(pool, size_class);
+	}
+	auto slot = pool->free[size_class];
+	pool->free[size_class] = slot->next;
+	return slot;
+}
+// Sets a mark bit; the helper thread may be setting others in the same
+// word:
+static void set_bit(uint64_t* word, uint64_t bit)
+{
+	if (bound_vm->gc_phase == GC_MARK_CONCURRENT)
+	{
+		__atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		*word |= bit;
+	}
+}
+// Finds the word holding obj's mark bit, in its page's bitmap or the
+// nursery's:
+static uint64_t* mark_word(Obj* obj, uint64_t* bit)
+{
+	if (obj->young)
+	{
+		auto grain = GRAIN_OF(obj, bound_vm->nursery);
+		*bit = BIT(grain);
+		return &bound_vm->nursery_marks[grain / 64];
+	}
+	auto grain = GRAIN_OF(obj, PAGE_BASE(obj));
+	*bit = BIT(grain);
+	return &PAGE_OF(obj)->marks[grain / 64];
+}
+static bool is_marked(Obj* obj)
+{
+	uint64_t bit;
+	auto word = mark_word(obj, &bit);
+	return (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) != 0;
+}
+static void set_mark(Obj* obj)
+{
+	uint64_t bit;
+	auto word = mark_word(obj, &bit);
+	set_bit(word, bit);
+}
+// Takes a slot for an old object and records it as in use; it is born
+// marked on a page still to be swept, or while the helper thread marks:
+static void* claim_slot(VM* vm, size_t size)
+{
+	char* slot;
+	if (size > POOL_MAX)
+	{
+		auto bytes = (POOL_GRAIN + size + POOL_PAGE - 1) / POOL_PAGE * POOL_PAGE;
+		auto page  = new_page(&vm->pool, bytes);
+		page->large = size;
+		slot = page->base + POOL_GRAIN;
+	}
+	else
+	{
+		slot = (char*)take_slot(vm, POOL_CLASS(size));
+	}
+	auto page  = PAGE_OF(slot);
+	auto grain = GRAIN_OF(slot, page->base);
+	page->live[grain / 64] |= BIT(grain);
+	if (page->unswept || vm->gc_phase == GC_MARK_CONCURRENT)
+	{
+		set_bit(&page->marks[grain / 64], BIT(grain));
+	}
+	return slot;
+}
+void* pool_alloc(VM* vm, size_t size)
+{
+	charge(vm, 0, size);
+	return claim_slot(vm, size);
+}
+void pool_free(VM* vm, void* ptr, size_t size)
+{
+	vm->bytes_allocated -= size;
+	auto page = PAGE_OF(ptr);
+	if (page->large > 0)
+	{
+		release_page(&vm->pool, page);
+		return;
+	}
+	auto grain = GRAIN_OF(ptr, page->base);
+	page->live[grain / 64] &= ~BIT(grain);
+	auto size_class = POOL_CLASS(size);
+	auto slot = (FreeSlot*)ptr;
+	slot->next = vm->pool.free[size_class];
+	vm->pool.free[size_class] = slot;
+}
+void free_pool(Pool* pool)
+{
+	auto page = pool->pages;
+	while (page != NULL)
+	{
+		auto next = page->next;
+		free(page->base);
+		free(page);
+		page = next;
+	}
+	init_pool(pool);
+}
+// Calls fn on every object in the pool pages:
+static void each_old(VM* vm, void (*fn)(Obj*))
+{
+	for (auto page = vm->pool.pages; page != NULL; page = page->next)
+	{
+		for (int i = 0; i < POOL_BITS; ++i)
+		{
+			for (auto bits = page->live[i]; bits != 0; bits &= bits - 1)
+			{
+				fn((Obj*)(page->base + (i * 64 + __builtin_ctzll(bits)) * POOL_GRAIN));
+			}
+		}
+	}
+}
+// Strings and closures carry their chars and upvalues inline, so their
+// size depends on the object; a forwarded young object has lost its len,
+// and has to be measured by its copy:
+static size_t obj_size(Obj* obj)
+{
+	switch (obj->type)
+	{
+		case OBJ_STRING:   return STRING_SIZE(((ObjString*)obj)->len);
+		case OBJ_MAP:      return sizeof(ObjMap);
+		case OBJ_FUNCTION: return sizeof(Function);
+		case OBJ_UPVALUE:  return sizeof(Upvalue);
+		case OBJ_CLOSURE:  return CLOSURE_SIZE(((Closure*)obj)->num_upvalues);
+		case OBJ_NATIVE:   return sizeof(Native);
+		case OBJ_ROPE:     return sizeof(Rope);
+		case OBJ_SHAPE:    return sizeof(Shape);
+	}
+	return 0;
+}
+// Frees what an object owns besides its own slot:
+static void free_contents(Obj* object)
 {
-	printf("%p free type %d\n", (void*)object, object->type);
 	switch (object->type)
+	{
+		case OBJ_FUNCTION:
+			free_Chunk(&((Function*)object)->chunk);
+			break;
+		case OBJ_MAP:
+		{
+			auto map = (ObjMap*)object;
+			FREE_ARRAY(Value, map->values, map->cap);
+			if (map->table != NULL)
+			{
+				free_map(map->table);
+				FREE(Map, map->table);
+			}
+			break;
+		}
+		case OBJ_SHAPE:
+			free_map(&((Shape*)object)->slots);
+			break;
+		case OBJ_STRING:
+		case OBJ_CLOSURE:
+		case OBJ_UPVALUE:
+		case OBJ_NATIVE:
+		case OBJ_ROPE:
+			break;
+	}
+}
+static void free_obj(VM* vm, Obj* object)
+{
+	#ifdef LOG_GC
+	printf("%p free type %d\n", (void*)object, object->type);
+	#endif
+	free_contents(object);
+	pool_free(vm, object, obj_size(object));
+}
+#define GRAIN_ROUND(size) (((size) + POOL_GRAIN - 1) / POOL_GRAIN * POOL_GRAIN)
+void* nursery_alloc(VM* vm, size_t size)
+{
+	size = GRAIN_ROUND(size);
+	if (size > NURSERY_MAX)
+	{
+		return NULL;
+	}
+	#ifdef STRESS_GC
+	minor_collect(vm);
+	#else
+	if (vm->nursery_top + size > vm->nursery_end)
+	{
+		minor_collect(vm);
+	}
+	#endif
+	auto result = vm->nursery_top;
+	vm->nursery_top += size;
+	return result;
+}
+// Grows a worklist of objects outside of reallocate(), so that it can
+// never start a collection:
+static void push_obj(Obj*** list, int* len, int* cap, Obj* obj)
+{
+	if (*len + 1 > *cap)
+	{
+		*cap  = GROW(*cap);
+		*list = (Obj**)realloc(*list, sizeof(Obj*) * *cap);
+		if (*list == NULL)
+		{
+			exit(1);
+		}
+	}
+	(*list)[(*len)++] = obj;
+}
+void remember(VM* vm, Obj* owner)
+{
+	owner->remembered = true;
+	push_obj(&vm->remembered, &vm->num_remembered, &vm->remembered_cap, owner);
+}
+// Where a forwarded young object's copy is stored; every object has a
+// word of body, and a string's hash and interned flag, which the intern
+// table is rekeyed by, lie past it:
+#define FORWARD(obj) (((Obj**)(obj))[1])
+// Copies a young object into the old heap, once, leaving a forwarding
+// pointer behind; returns where the object now lives:
+static Obj* promote(VM* vm, Obj* obj)
+{
+	if (obj == NULL || !obj->young)
+	{
+		return obj;
+	}
+	if (is_marked(obj))
+	{
+		return FORWARD(obj);
+	}
+	auto size = obj_size(obj);
+	auto copy = (Obj*)claim_slot(vm, size);
+	memcpy(copy, obj, size);
+	if (obj->type == OBJ_UPVALUE)
+	{
+		auto upvalue = (Upvalue*)obj;
+		if (upvalue->loc == &upvalue->closed)
+		{
+			((Upvalue*)copy)->loc = &((Upvalue*)copy)->closed;
+		}
+	}
+	copy->young = false;
+	vm->bytes_allocated += size;
+	vm->bytes_promoted  += size;
+	vm->gc_debt         += size;
+
+	set_mark(obj);
+	FORWARD(obj) = copy;
+	push_obj(&vm->gray, &vm->num_gray, &vm->gray_cap, copy);
+	return copy;
+}
+static void promote_val(VM* vm, Value* slot)
+{
+	if (IS_YOUNG(*slot))
+	{
+		*slot = OBJ_VAL(promote(vm, AS_OBJ(*slot)));
+	}
+}
+static void promote_array(VM* vm, ValueArray* array)
+{
+	for (int i = 0; i < array->len; ++i)
+	{
+		promote_val(vm, &array->values[i]);
+	}
+}
+// Moved keys keep their hashes, and so their places:
+static void promote_map(VM* vm, Map* map)
+{
+	for (uint64_t i = 0; i < map->cap; ++i)
+	{
+		auto entry = &map->entries[i];
+		entry->key = (ObjString*)promote(vm, (Obj*)entry->key);
+		promote_val(vm, &entry->value);
+	}
+}
+// Promotes whatever young objects an old one points at:
+static void promote_children(VM* vm, Obj* obj)
+{
+	switch (obj->type)
 	{
 		case OBJ_FUNCTION:
 		{
-			auto func = (Function*)object;
-			free_Chunk(&func->chunk);
-			FREE(Function, object);
+			auto func = (Function*)obj;
+			func->name = (ObjString*)promote(vm, (Obj*)func->name);
+			promote_array(vm, &func->chunk.consts);
 			break;
 		}
 		case OBJ_CLOSURE:
 		{
-			auto closure = (Closure*)object;
-			FREE_ARRAY(Upvalue*, closure->upvalues, closure->num_upvalues);
-			FREE(Closure, object);
+			auto closure = (Closure*)obj;
+			closure->func = (Function*)promote(vm, (Obj*)closure->func);
+			for (uint64_t i = 0; i < closure->num_upvalues; ++i)
+			{
+				closure->upvalues[i] = (Upvalue*)promote(vm, (Obj*)closure->upvalues[i]);
+			}
 			break;
 		}
 		case OBJ_UPVALUE:
+			// An open upvalue's next is fixed up with the open list:
+			promote_val(vm, &((Upvalue*)obj)->closed);
+			break;
+		case OBJ_MAP:
 		{
-			FREE(Upvalue, object);
+			auto map = (ObjMap*)obj;
+			if (map->table != NULL)
+			{
+				promote_map(vm, map->table);
+				break;
+			}
+			for (uint64_t i = 0; i < map->shape->slots.len; ++i)
+			{
+				promote_val(vm, &map->values[i]);
+			}
 			break;
 		}
-		case OBJ_STRING:
+		case OBJ_SHAPE:
 		{
-			ObjString* string = (ObjString*)object;
-			FREE_ARRAY(char, string->chars, string->len + 1);
-			FREE(ObjString, object);
+			auto shape = (Shape*)obj;
+			shape->key = (ObjString*)promote(vm, (Obj*)shape->key);
+			promote_map(vm, &shape->slots);
 			break;
 		}
-		case OBJ_NATIVE:
+		case OBJ_ROPE:
 		{
-			FREE(Native, object);
+			auto rope = (Rope*)obj;
+			rope->left  = promote(vm, rope->left);
+			rope->right = promote(vm, rope->right);
+			break;
+		}
+		case OBJ_STRING:
+		case OBJ_NATIVE:
 			break;
+	}
+}
+static void clear_nursery_marks(VM* vm)
+{
+	auto grains = GRAIN_OF(vm->nursery_top, vm->nursery);
+	memset(vm->nursery_marks, 0, (grains + 63) / 64 * sizeof(uint64_t));
+}
+// Drops dead young objects, and points the weak intern table at the
+// promoted copies of live strings:
+static void sweep_nursery(VM* vm)
+{
+	for (auto ptr = vm->nursery; ptr < vm->nursery_top;)
+	{
+		auto obj = (Obj*)ptr;
+		auto marked = is_marked(obj);
+		ptr += GRAIN_ROUND(obj_size(marked ? FORWARD(obj) : obj));
+		auto interned = obj->type == OBJ_STRING && ((ObjString*)obj)->interned;
+		if (marked)
+		{
+			if (interned)
+			{
+				rekey_map(&vm->strings, (ObjString*)obj, (ObjString*)FORWARD(obj));
+			}
+			continue;
 		}
+		#ifdef LOG_GC
+		printf("%p free young type %d\n", (void*)obj, obj->type);
+		#endif
+		if (interned)
+		{
+			rm_map(&vm->strings, (ObjString*)obj);
+		}
+		free_contents(obj);
 	}
+	clear_nursery_marks(vm);
+	vm->nursery_top = vm->nursery;
 }
-static void mark_roots(VM* vm)
+void minor_collect(VM* vm)
+{
+	#ifdef LOG_GC
+	puts("Begin minor GC");
+	auto promoted = vm->bytes_promoted;
+	#endif
+	// Objects move, so the helper thread has to wait:
+	auto locked = vm->gc_phase == GC_MARK_CONCURRENT;
+	if (locked)
+	{
+		lock_heap(vm);
+	}
+	// Promoted objects are queued above any gray objects of a major
+	// collection in progress:
+	auto base = vm->num_gray;
+	for (auto slot = vm->stack; slot < vm->top; ++slot)
+	{
+		promote_val(vm, slot);
+	}
+	for (int i = 0; i < vm->num_frames; ++i)
+	{
+		vm->frames[i].closure = (Closure*)promote(vm, (Obj*)vm->frames[i].closure);
+	}
+	for (auto link = &vm->open_upvalues; *link != NULL; link = &(*link)->next)
+	{
+		*link = (Upvalue*)promote(vm, (Obj*)*link);
+	}
+	if (vm->globals_dirty)
+	{
+		promote_array(vm, &vm->globals);
+		vm->globals_dirty = false;
+	}
+	for (int i = 0; i < vm->num_remembered; ++i)
+	{
+		vm->remembered[i]->remembered = false;
+		promote_children(vm, vm->remembered[i]);
+	}
+	vm->num_remembered = 0;
+	for (auto i = base; i < vm->num_gray; ++i)
+	{
+		promote_children(vm, vm->gray[i]);
+	}
+	if (vm->gc_phase == GC_MARK || vm->gc_phase == GC_MARK_CONCURRENT)
+	{
+		// Whatever survives is live for the major collection too; leave it
+		// gray for an incremental marker, or black for a concurrent one:
+		for (auto i = base; i < vm->num_gray; ++i)
+		{
+			set_mark(vm->gray[i]);
+		}
+	}
+	if (vm->gc_phase != GC_MARK)
+	{
+		vm->num_gray = base;
+	}
+	sweep_nursery(vm);
+	++vm->num_minor;
+	if (locked)
+	{
+		unlock_heap(vm);
+	}
+	#ifdef LOG_GC
+	printf("End minor GC: promoted %zu\n", vm->bytes_promoted - promoted);
+	#endif
+
+	if (vm->bytes_allocated > vm->peak_heap)
+	{
+		vm->peak_heap = vm->bytes_allocated;
+	}
+	maybe_collect(vm);
+}
+static void mark_array(ValueArray* array)
+{
+	for (int i = 0; i < array->len; ++i)
+	{
+		mark_val(array->values[i]);
+	}
+}
+static void mark_map(Map* map)
+{
+	for (uint64_t i = 0; i < map->cap; ++i)
+	{
+		auto entry = &map->entries[i];
+		mark_obj((Obj*)entry->key);
+		mark_val(entry->value);
+	}
+}
+// The roots stored to without a barrier:
+static void mark_stack_roots(VM* vm)
 {
 	for (auto slot = vm->stack; slot < vm->top; ++slot)
 	{
 		mark_val(*slot);
 	}
+	for (int i = 0; i < vm->num_frames; ++i)
+	{
+		mark_obj((Obj*)vm->frames[i].closure);
+	}
+	for (auto upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next)
+	{
+		mark_obj((Obj*)upvalue);
+	}
+	mark_map(&vm->global_slots);
+	if (vm->compiler != NULL)
+	{
+		vm->compiler->mark_roots();
+	}
+}
+static void mark_roots(VM* vm)
+{
+	mark_stack_roots(vm);
+	mark_array(&vm->globals);
+	for (int i = 0; i < SMALL_INTS; ++i)
+	{
+		mark_obj((Obj*)vm->small_ints[i]);
+	}
+	mark_obj((Obj*)vm->root_shape);
 }
 void  mark_obj(Obj* obj)
 {
-	if (obj == NULL)
+	// An incremental collection leaves young objects to the minor
+	// collection that precedes its final pause; a concurrent one only
+	// marks what was old when it began:
+	if (obj == NULL || (obj->young && bound_vm->gc_phase != GC_IDLE) || is_marked(obj))
 	{
 		return;
 	}
+	#ifdef LOG_GC
 	printf("%p mark ", (void*)obj);
 	print_val(OBJ_VAL(obj));
 	printf("\n");
-	obj->marked = true;
+	#endif
+	set_mark(obj);
+	// Gray until its children are traced; the worklist grows outside of
+	// reallocate() so that marking can never start another collection:
+	auto vm = bound_vm;
+	push_obj(&vm->gray, &vm->num_gray, &vm->gray_cap, obj);
 }
 void mark_val(Value val)
 {
@@ -86,19 +639,659 @@ void mark_val(Value val)
 	}
 	mark_obj(AS_OBJ(val));
 }
+static void blacken(Obj* obj)
+{
+	switch (obj->type)
+	{
+		case OBJ_FUNCTION:
+		{
+			auto func = (Function*)obj;
+			mark_obj((Obj*)func->name);
+			mark_array(&func->chunk.consts);
+			break;
+		}
+		case OBJ_CLOSURE:
+		{
+			auto closure = (Closure*)obj;
+			mark_obj((Obj*)closure->func);
+			for (uint64_t i = 0; i < closure->num_upvalues; ++i)
+			{
+				mark_obj((Obj*)closure->upvalues[i]);
+			}
+			break;
+		}
+		case OBJ_UPVALUE:
+			mark_val(((Upvalue*)obj)->closed);
+			break;
+		case OBJ_MAP:
+		{
+			auto map = (ObjMap*)obj;
+			mark_obj((Obj*)map->shape);
+			if (map->table != NULL)
+			{
+				mark_map(map->table);
+				break;
+			}
+			for (uint64_t i = 0; i < map->shape->slots.len; ++i)
+			{
+				mark_val(map->values[i]);
+			}
+			break;
+		}
+		case OBJ_SHAPE:
+		{
+			auto shape = (Shape*)obj;
+			mark_obj((Obj*)shape->key);
+			mark_map(&shape->slots);
+			mark_obj((Obj*)shape->children);
+			mark_obj((Obj*)shape->sibling);
+			break;
+		}
+		case OBJ_ROPE:
+			mark_obj(((Rope*)obj)->left);
+			mark_obj(((Rope*)obj)->right);
+			break;
+		case OBJ_STRING:
+		case OBJ_NATIVE:
+			break;
+	}
+}
+static void trace(VM* vm)
+{
+	while (vm->num_gray > 0)
+	{
+		blacken(vm->gray[--vm->num_gray]);
+	}
+}
+// --gc-verify: every object the roots reach must be marked by the end of a
+// mark, so marked objects may only point at marked or young ones. Young
+// objects during a concurrent mark were all made after it began, and are
+// held to the same rule:
+static void verify_ref(Obj* owner, Obj* obj)
+{
+	if (obj != NULL && !obj->young && !is_marked(obj))
+	{
+		printf("GC verify: %p (type %d) points at unmarked %p (type %d)\n",
+			(void*)owner, owner != NULL ? (int)owner->type : -1, (void*)obj, obj->type);
+		exit(1);
+	}
+}
+static void verify_val(Obj* owner, Value val)
+{
+	if (IS_OBJ(val))
+	{
+		verify_ref(owner, AS_OBJ(val));
+	}
+}
+static void verify_map(Obj* owner, Map* map)
+{
+	for (uint64_t i = 0; i < map->cap; ++i)
+	{
+		verify_ref(owner, (Obj*)map->entries[i].key);
+		verify_val(owner, map->entries[i].value);
+	}
+}
+static void verify_children(Obj* obj)
+{
+	switch (obj->type)
+	{
+		case OBJ_FUNCTION:
+		{
+			auto func = (Function*)obj;
+			verify_ref(obj, (Obj*)func->name);
+			for (int i = 0; i < func->chunk.consts.len; ++i)
+			{
+				verify_val(obj, func->chunk.consts.values[i]);
+			}
+			break;
+		}
+		case OBJ_CLOSURE:
+		{
+			auto closure = (Closure*)obj;
+			verify_ref(obj, (Obj*)closure->func);
+			for (uint64_t i = 0; i < closure->num_upvalues; ++i)
+			{
+				verify_ref(obj, (Obj*)closure->upvalues[i]);
+			}
+			break;
+		}
+		case OBJ_UPVALUE:
+			verify_val(obj, ((Upvalue*)obj)->closed);
+			break;
+		case OBJ_MAP:
+		{
+			auto map = (ObjMap*)obj;
+			verify_ref(obj, (Obj*)map->shape);
+			if (map->table != NULL)
+			{
+				verify_map(obj, map->table);
+				break;
+			}
+			for (uint64_t i = 0; i < map->shape->slots.len; ++i)
+			{
+				verify_val(obj, map->values[i]);
+			}
+			break;
+		}
+		case OBJ_SHAPE:
+		{
+			auto shape = (Shape*)obj;
+			verify_ref(obj, (Obj*)shape->key);
+			verify_map(obj, &shape->slots);
+			verify_ref(obj, (Obj*)shape->children);
+			verify_ref(obj, (Obj*)shape->sibling);
+			break;
+		}
+		case OBJ_ROPE:
+			verify_ref(obj, ((Rope*)obj)->left);
+			verify_ref(obj, ((Rope*)obj)->right);
+			break;
+		case OBJ_STRING:
+		case OBJ_NATIVE:
+			break;
+	}
+}
+static void verify_marked(Obj* obj)
+{
+	if (is_marked(obj))
+	{
+		verify_children(obj);
+	}
+}
+static void verify_heap(VM* vm)
+{
+	for (auto slot = vm->stack; slot < vm->top; ++slot)
+	{
+		verify_val(NULL, *slot);
+	}
+	for (int i = 0; i < vm->num_frames; ++i)
+	{
+		verify_ref(NULL, (Obj*)vm->frames[i].closure);
+	}
+	for (auto upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next)
+	{
+		verify_ref(NULL, (Obj*)upvalue);
+	}
+	for (int i = 0; i < vm->globals.len; ++i)
+	{
+		verify_val(NULL, vm->globals.values[i]);
+	}
+	for (uint64_t i = 0; i < vm->global_slots.cap; ++i)
+	{
+		verify_ref(NULL, (Obj*)vm->global_slots.entries[i].key);
+	}
+	for (int i = 0; i < SMALL_INTS; ++i)
+	{
+		verify_ref(NULL, (Obj*)vm->small_ints[i]);
+	}
+	verify_ref(NULL, (Obj*)vm->root_shape);
+	each_old(vm, verify_marked);
+	for (auto ptr = vm->nursery; ptr < vm->nursery_top;)
+	{
+		auto obj = (Obj*)ptr;
+		ptr += GRAIN_ROUND(obj_size(obj));
+		if (vm->gc_phase == GC_MARK_CONCURRENT || is_marked(obj))
+		{
+			verify_children(obj);
+		}
+	}
+}
+static uint64_t now_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+static void record_pause(VM* vm, uint64_t start)
+{
+	auto us = (now_ns() - start) / 1000;
+	int bucket = 0;
+	while (bucket < GC_PAUSE_BUCKETS - 1 && (1ull << bucket) <= us)
+	{
+		++bucket;
+	}
+	++vm->pauses[bucket];
+	if (us > vm->max_pause)
+	{
+		vm->max_pause = us;
+	}
+}
+// Everything marked is live; clears marks left on the young, and forgets
+// remembered objects about to be freed:
+static void finish_mark(VM* vm)
+{
+	if (vm->gc_verify)
+	{
+		verify_heap(vm);
+	}
+	clear_nursery_marks(vm);
+	auto kept = 0;
+	for (int i = 0; i < vm->num_remembered; ++i)
+	{
+		if (is_marked(vm->remembered[i]))
+		{
+			vm->remembered[kept++] = vm->remembered[i];
+		}
+	}
+	vm->num_remembered = kept;
+}
+static void finish_cycle(VM* vm)
+{
+	vm->gc_phase = GC_IDLE;
+	++vm->num_collections;
+	#ifdef LOG_GC
+	printf("End GC: heap %zu, next at %zu\n", vm->bytes_allocated, vm->next_gc);
+	#endif
+}
+// Hands what a finished mark left white to the sweep: a slice at a time
+// with a budget, otherwise lazily (see LAZY_SWEEP). The next collection is
+// scheduled off the unswept heap, and brought forward as the sweep frees
+// it:
+static void begin_sweep(VM* vm)
+{
+	finish_mark(vm);
+	vm->next_gc = vm->bytes_allocated * vm->gc_growth;
+	if (vm->next_gc < GC_MIN_HEAP)
+	{
+		vm->next_gc = GC_MIN_HEAP;
+	}
+	for (auto page = vm->pool.pages; page != NULL; page = page->next)
+	{
+		page->unswept = true;
+	}
+	vm->sweep_page    = vm->pool.pages;
+	vm->strings_swept = 0;
+	vm->strings_sweep = vm->strings.entries;
+	vm->gc_phase      = GC_SWEEP;
+	if (vm->sweep_page == NULL)
+	{
+		finish_cycle(vm);
+	}
+}
 void collect(VM* vm)
 {
+	#ifdef LOG_GC
 	puts("Begin GC");
+	#endif
+	auto start = now_ns();
+	mark_roots(vm);
+	trace(vm);
+	begin_sweep(vm);
+	record_pause(vm, start);
+}
+// The final pause of an incremental mark; the nursery must be empty, as
+// minor collections only run where objects may move:
+static void remark(VM* vm)
+{
+	mark_stack_roots(vm);
+	trace(vm);
+	begin_sweep(vm);
+}
+// Frees what is in use on a page but unmarked, and clears its marks for
+// the next cycle; returns the objects looked at:
+static int sweep_page(VM* vm, PoolPage* page)
+{
+	page->unswept = false;
+	if (page->large > 0)
+	{
+		if ((page->marks[0] & page->live[0]) == 0)
+		{
+			// Takes the page with it:
+			free_obj(vm, (Obj*)(page->base + POOL_GRAIN));
+		}
+		else
+		{
+			page->marks[0] = 0;
+		}
+		return 1;
+	}
+	int seen = 0;
+	for (int i = 0; i < POOL_BITS; ++i)
+	{
+		seen += __builtin_popcountll(page->live[i]);
+		for (auto dead = page->live[i] & ~page->marks[i]; dead != 0; dead &= dead - 1)
+		{
+			free_obj(vm, (Obj*)(page->base + (i * 64 + __builtin_ctzll(dead)) * POOL_GRAIN));
+		}
+		page->marks[i] = 0;
+	}
+	return seen;
+}
+// The intern table holds its strings weakly: before any page is swept,
+// the strings marking left white are dropped from it, SWEEP_STRINGS
+// entries a work unit. Young ones are the nursery's, and old ones on pages
+// made since the sweep began are live. A rehash meanwhile starts it over:
+static int sweep_strings(VM* vm, int work)
+{
+	auto strings = &vm->strings;
+	if (strings->entries != vm->strings_sweep)
+	{
+		vm->strings_swept = 0;
+		vm->strings_sweep = strings->entries;
+	}
+	auto left  = (int)((strings->cap - vm->strings_swept + SWEEP_STRINGS - 1) / SWEEP_STRINGS);
+	auto units = work < left ? work : left;
+	auto end   = vm->strings_swept + (uint64_t)units * SWEEP_STRINGS;
+	if (end > strings->cap)
+	{
+		end = strings->cap;
+	}
+	for (; vm->strings_swept < end; ++vm->strings_swept)
+	{
+		auto key = strings->entries[vm->strings_swept].key;
+		if (key != NULL && !key->header.young && PAGE_OF(key)->unswept &&
+			!is_marked((Obj*)key))
+		{
+			rm_map(strings, key);
+		}
+	}
+	if (vm->strings_swept == strings->cap)
+	{
+		vm->strings_sweep = NULL;
+	}
+	return work - units;
+}
+// Pages carved during the sweep go in front of it, and are never visited:
+static void sweep_slice(VM* vm, int work)
+{
+	auto before = vm->bytes_allocated;
+	if (vm->strings_sweep != NULL)
+	{
+		work = sweep_strings(vm, work);
+	}
+	while (work > 0 && vm->sweep_page != NULL)
+	{
+		auto page = vm->sweep_page;
+		vm->sweep_page = page->next;
+		work -= sweep_page(vm, page) + 1;
+	}
+	auto freed = before - vm->bytes_allocated;
+	vm->bytes_freed += freed;
+	auto early = (size_t)(freed * vm->gc_growth);
+	vm->next_gc = vm->next_gc > GC_MIN_HEAP + early ? vm->next_gc - early : GC_MIN_HEAP;
+	if (vm->sweep_page == NULL)
+	{
+		finish_cycle(vm);
+	}
+}
+static void gc_slice(VM* vm)
+{
+	auto start = now_ns();
+	auto work  = vm->gc_budget;
+	auto debt  = vm->gc_debt / GC_WORK_BYTES;
+	work = debt < (size_t)(INT_MAX - work) ? work + (int)debt : INT_MAX;
+	if (vm->bytes_allocated > vm->next_gc * GC_OVERRUN)
+	{
+		work = INT_MAX;
+	}
+	vm->gc_debt = 0;
+	if (vm->gc_phase == GC_MARK)
+	{
+		for (; work > 0 && vm->num_gray > 0; --work)
+		{
+			blacken(vm->gray[--vm->num_gray]);
+		}
+		if (vm->num_gray == 0 && vm->nursery_top == vm->nursery)
+		{
+			remark(vm);
+		}
+	}
+	else
+	{
+		sweep_slice(vm, work);
+	}
+	record_pause(vm, start);
+}
+void lock_heap(VM* vm)
+{
+	++vm->gc_waiting;
+	pthread_mutex_lock(&vm->gc_lock);
+	--vm->gc_waiting;
+}
+void unlock_heap(VM* vm)
+{
+	pthread_cond_signal(&vm->gc_wake);
+	pthread_mutex_unlock(&vm->gc_lock);
+}
+// The helper thread: blackens gray objects a batch at a time, and gives
+// the heap up whenever the script is waiting for it:
+static void* mark_thread(void* arg)
+{
+	auto vm = (VM*)arg;
+	pthread_mutex_lock(&vm->gc_lock);
+	while (!vm->marker_quit)
+	{
+		if (vm->gc_phase != GC_MARK_CONCURRENT || vm->num_gray == 0 || vm->gc_waiting > 0)
+		{
+			if (vm->gc_phase == GC_MARK_CONCURRENT && vm->num_gray == 0)
+			{
+				vm->mark_idle = true;
+			}
+			pthread_cond_wait(&vm->gc_wake, &vm->gc_lock);
+			continue;
+		}
+		for (int work = MARK_BATCH; work > 0 && vm->num_gray > 0; --work)
+		{
+			blacken(vm->gray[--vm->num_gray]);
+		}
+	}
+	pthread_mutex_unlock(&vm->gc_lock);
+	return NULL;
+}
+void stop_marker(VM* vm)
+{
+	if (!vm->marker_started)
+	{
+		return;
+	}
+	lock_heap(vm);
+	vm->marker_quit = true;
+	unlock_heap(vm);
+	pthread_join(vm->marker, NULL);
+	vm->marker_started = false;
+}
+// Gray the logged objects for the helper thread; the heap must be locked:
+static void shade_satb(VM* vm)
+{
+	for (int i = 0; i < vm->num_satb; ++i)
+	{
+		mark_obj(vm->satb[i]);
+	}
+	vm->num_satb  = 0;
+	vm->mark_idle = false;
+}
+void satb_log(VM* vm, Obj* obj)
+{
+	if (obj == NULL || obj->young)
+	{
+		return;
+	}
+	push_obj(&vm->satb, &vm->num_satb, &vm->satb_cap, obj);
+	if (vm->num_satb >= SATB_FLUSH)
+	{
+		lock_heap(vm);
+		shade_satb(vm);
+		unlock_heap(vm);
+	}
+}
+// A string the intern table handed back, which the script may now keep:
+// the helper thread is told of it, and a sweep yet to reach it keeps it.
+void intern_found(VM* vm, Obj* obj)
+{
+	if (obj->young)
+	{
+		return;
+	}
+	if (vm->gc_phase == GC_MARK_CONCURRENT)
+	{
+		satb_log(vm, obj);
+	}
+	else if (vm->gc_phase == GC_SWEEP && PAGE_OF(obj)->unswept)
+	{
+		set_mark(obj);
+	}
+}
+void satb_store(VM* vm, Value* slot, Value val)
+{
+	lock_heap(vm);
+	auto old = *slot;
+	*slot = val;
+	unlock_heap(vm);
+	if (IS_OBJ(old))
+	{
+		satb_log(vm, AS_OBJ(old));
+	}
+}
+static void begin_concurrent(VM* vm)
+{
+	#ifdef LOG_GC
+	puts("Begin concurrent GC");
+	#endif
+	auto start = now_ns();
+	if (!vm->marker_started)
+	{
+		vm->marker_quit = false;
+		if (pthread_create(&vm->marker, NULL, mark_thread, vm) != 0)
+		{
+			puts("Could not start the marking thread");
+			exit(1);
+		}
+		vm->marker_started = true;
+	}
+	lock_heap(vm);
+	vm->gc_phase  = GC_MARK_CONCURRENT;
+	vm->mark_idle = false;
 	mark_roots(vm);
-	puts("End GC");
+	unlock_heap(vm);
+	record_pause(vm, start);
+}
+// The final pause of a concurrent mark, once the helper thread has run out
+// of gray objects: traces what the script logged since.
+static void remark_concurrent(VM* vm)
+{
+	auto start = now_ns();
+	lock_heap(vm);
+	shade_satb(vm);
+	trace(vm);
+	begin_sweep(vm);
+	unlock_heap(vm);
+	record_pause(vm, start);
+}
+static void maybe_collect(VM* vm)
+{
+	if (vm->gc_defer > 0)
+	{
+		return;
+	}
+	if (vm->gc_phase == GC_MARK_CONCURRENT)
+	{
+		if (vm->mark_idle)
+		{
+			remark_concurrent(vm);
+		}
+		return;
+	}
+	if (vm->gc_phase == GC_MARK || (vm->gc_phase == GC_SWEEP && vm->gc_budget > 0))
+	{
+		gc_slice(vm);
+		return;
+	}
+	if (vm->gc_phase == GC_SWEEP)
+	{
+		// A collection due before the lazy sweep is done finishes it
+		// first:
+		if (vm->bytes_allocated <= vm->next_gc)
+		{
+			return;
+		}
+		auto start = now_ns();
+		while (vm->gc_phase == GC_SWEEP)
+		{
+			sweep_slice(vm, LAZY_SWEEP);
+		}
+		record_pause(vm, start);
+	}
+	#ifndef STRESS_GC
+	if (vm->bytes_allocated <= vm->next_gc)
+	{
+		return;
+	}
+	#endif
+	if (vm->gc_concurrent && vm->num_frames > 0)
+	{
+		// Only while the script runs; the helper thread never looks into
+		// the nursery, so the snapshot waits for a minor collection to
+		// empty it:
+		if (vm->nursery_top == vm->nursery)
+		{
+			begin_concurrent(vm);
+		}
+		return;
+	}
+	if (vm->gc_budget <= 0)
+	{
+		collect(vm);
+		return;
+	}
+	#ifdef LOG_GC
+	puts("Begin incremental GC");
+	#endif
+	auto start = now_ns();
+	vm->gc_debt  = 0;
+	vm->gc_phase = GC_MARK;
+	mark_roots(vm);
+	record_pause(vm, start);
+}
+void print_gc_stats(VM* vm)
+{
+	fprintf(stderr,
+		"gc: %lu collections, %zu bytes freed, heap %zu bytes (peak %zu)\n"
+		"gc: %lu minor collections, %zu bytes promoted\n"
+		"gc: %d of %d shapes\n",
+		vm->num_collections, vm->bytes_freed, vm->bytes_allocated, vm->peak_heap,
+		vm->num_minor, vm->bytes_promoted,
+		vm->num_shapes, SHAPE_BUDGET);
+	uint64_t total = 0;
+	for (int i = 0; i < GC_PAUSE_BUCKETS; ++i)
+	{
+		total += vm->pauses[i];
+	}
+	if (total == 0)
+	{
+		return;
+	}
+	fprintf(stderr, "gc: %lu pauses, max %luus\n", total, vm->max_pause);
+	uint64_t seen = 0;
+	bool p50 = false, p99 = false;
+	for (int i = 0; i < GC_PAUSE_BUCKETS; ++i)
+	{
+		if (vm->pauses[i] == 0)
+		{
+			continue;
+		}
+		seen += vm->pauses[i];
+		fprintf(stderr, "gc:   < %8luus %8lu", 1ul << i, vm->pauses[i]);
+		if (!p50 && seen * 2 >= total)
+		{
+			fprintf(stderr, "  p50");
+			p50 = true;
+		}
+		if (!p99 && seen * 100 >= total * 99)
+		{
+			fprintf(stderr, "  p99");
+			p99 = true;
+		}
+		fprintf(stderr, "\n");
+	}
 }
 void free_objects(VM* vm)
 {
-  Obj* object = vm->objects;
-  while (object != NULL)
+  for (auto ptr = vm->nursery; ptr < vm->nursery_top;)
   {
-    Obj* next = object->next;
-    free_obj(object);
-    object = next;
+    auto obj = (Obj*)ptr;
+    ptr += GRAIN_ROUND(obj_size(obj));
+    free_contents(obj);
   }
+  vm->nursery_top = vm->nursery;
+  each_old(vm, free_contents);
 }
@@ -3,7 +3,69 @@
 #include <stddef.h>
 #include "value.hpp"
 #include "vm.hpp"
-#define STRESS_GC
+// Debug builds: -DSTRESS_GC collects before every allocation that grows the
+// heap, -DLOG_GC traces allocation, marking and freeing.
+// Otherwise a collection runs once the heap passes next_gc, which is then
+// set to the surviving heap times the VM's gc_growth (never below
+// GC_MIN_HEAP):
+#define GC_GROWTH   2.0
+#define GC_MIN_HEAP (1024 * 1024)
+// Without a gc_budget, the objects a collection leaves white are freed
+// lazily: an allocation that finds its size class empty first sweeps
+// LAZY_SWEEP more objects, and the next collection finishes what is left.
+// The intern table is swept first, SWEEP_STRINGS entries for each object;
+// a string it hands back meanwhile goes through INTERN_BARRIER, so that
+// the sweep keeps it:
+#define LAZY_SWEEP    256
+#define SWEEP_STRINGS 16
+// Objects the running script makes are bump-allocated in a nursery of
+// NURSERY_SIZE bytes. When it fills, a minor collection copies the young
+// objects still reachable from the roots and the remembered set into the
+// old heap and empties the nursery; only old-heap growth counts towards
+// next_gc. Objects over NURSERY_MAX bytes are made old.
+#define NURSERY_SIZE (256 * 1024)
+#define NURSERY_MAX  (NURSERY_SIZE / 64)
+#define IS_YOUNG(val) (IS_OBJ(val) && AS_OBJ(val)->young)
+// With gc_budget set, a major collection is spread over slices run as the
+// heap grows. Each does gc_budget units of work, and one more for every
+// GC_WORK_BYTES allocated or promoted since the last, so that the script
+// cannot outrun it; once the heap is GC_OVERRUN times next_gc, a slice
+// finishes the mark or sweep outright. While it marks, values stored into objects or globals are
+// shaded so that no black object ends up pointing at a white one; the
+// stack and other roots are rescanned in one final pause.
+#define GC_WORK_BYTES 16
+#define GC_OVERRUN    1.5
+// Must guard every store of a value into an old object:
+#define WRITE_BARRIER(vm, owner, val) do { \
+		if ((vm)->gc_phase == GC_MARK) \
+		{ \
+			mark_val(val); \
+		} \
+		if (IS_YOUNG(val) && !(owner)->young && !(owner)->remembered) \
+		{ \
+			remember(vm, owner); \
+		} } while (false)
+// And every store into a global:
+#define GLOBAL_BARRIER(vm, val) do { \
+		if ((vm)->gc_phase == GC_MARK) \
+		{ \
+			mark_val(val); \
+		} \
+		(vm)->globals_dirty |= IS_YOUNG(val); } while (false)
+// With gc_concurrent set, a major collection instead snapshots the roots
+// just after a minor collection, and a helper thread marks from them while
+// the script runs on. Objects promoted or made old meanwhile are born
+// black; an object the script could lose track of is logged first, with
+// satb_store for a value overwritten inside an old object and
+// INTERN_BARRIER for a string the weak intern table hands back. The final
+// pause only traces from what was logged.
+#define MARK_BATCH 64
+#define SATB_FLUSH 256
+#define INTERN_BARRIER(vm, str) do { \
+		if ((vm)->gc_phase != GC_IDLE) \
+		{ \
+			intern_found(vm, (Obj*)(str)); \
+		} } while (false)
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
 #define FREE(type, val) \
@@ -11,12 +73,27 @@
 #define GROW(x) \
 	((x) < 8 ? 8 : (x) * 2)
 #define GROW_ARRAY(type, ptr, old, next) \
-	(type*)reallocate(ptr, sizeof(type) * old, sizeof(type) * next)
+	(type*)reallocate(ptr, sizeof(type) * (old), sizeof(type) * (next))
 #define FREE_ARRAY(type, ptr, old) \
-	(type*)reallocate(ptr, sizeof(type) * old, 0);
+	(type*)reallocate(ptr, sizeof(type) * (old), 0);
 void* reallocate(void* ptr, size_t old, size_t next);
+void* pool_alloc(VM* vm, size_t size);
+void  pool_free(VM* vm, void* ptr, size_t size);
+void  init_pool(Pool* pool);
+void* nursery_alloc(VM* vm, size_t size);
+void  remember(VM* vm, Obj* owner);
+void  minor_collect(VM* vm);
+void  free_pool(Pool* pool);
+void  bind_vm(VM* vm);
 void  mark_obj(Obj* obj);
 void  mark_val(Value val);
 void  collect(VM* vm);
 void  free_objects(VM* vm);
+void  print_gc_stats(VM* vm);
+void  lock_heap(VM* vm);
+void  unlock_heap(VM* vm);
+void  satb_log(VM* vm, Obj* obj);
+void  intern_found(VM* vm, Obj* obj);
+void  satb_store(VM* vm, Value* slot, Value val);
+void  stop_marker(VM* vm);
 #endif
@@ -7,7 +7,8 @@ NATIVE(IO, print)
 {
 	for (int i = 0; i < num_args; ++i)
 	{
-		printf("%s\n", AS_CSTRING(vm->to_string_val(stack[i])));
+		stack[i] = vm->to_string_val(stack[i]);
+		printf("%s\n", flatten(vm, &stack[i])->chars);
 	}
 	return NULL_VAL;
 }
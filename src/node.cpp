@@ -34,6 +34,8 @@ void Node::destroy(Base* node)
 		HANDLE (FUNCBODY, FuncBody);
 		HANDLE (RETURN,   Return);
 		HANDLE (FUNCCALL, FuncCall);
+		HANDLE (MAP,      MapLit);
+		HANDLE (SUBSCRIPT, Subscript);
 		HANDLE (IF,       If);
 		HANDLE (WHILE,    While);
 		HANDLE (FIN,      Base);
@@ -271,6 +273,30 @@ FuncCall::~FuncCall()
 	}
 	destroy(this->callee);
 }
+MapLit::MapLit() : Base(NODE_MAP)
+{
+}
+MapLit::~MapLit()
+{
+	for (auto item = this->keys.begin(); item != this->keys.end(); ++item)
+	{
+		destroy(*item);
+	}
+	for (auto item = this->values.begin(); item != this->values.end(); ++item)
+	{
+		destroy(*item);
+	}
+}
+Subscript::Subscript(Base* map, Base* key) : Base(NODE_SUBSCRIPT)
+{
+	this->map = map;
+	this->key = key;
+}
+Subscript::~Subscript()
+{
+	destroy(this->map);
+	destroy(this->key);
+}
 If::If(Base* cond, Base* then, Base* other) : Base(NODE_IF)
 {
 	this->cond  = cond;
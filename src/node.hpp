@@ -24,6 +24,8 @@ typedef enum
 	NODE_FUNCBODY,
 	NODE_RETURN,
 	NODE_FUNCCALL,
+	NODE_MAP,
+	NODE_SUBSCRIPT,
 	NODE_FIN,
 } NodeType;
 namespace Node
@@ -203,6 +205,22 @@ namespace Node
 		FuncCall(Base* callee);
 		~FuncCall();
 	};
+	class MapLit: public Base
+	{
+	public:
+		std::vector<Base*> keys;
+		std::vector<Base*> values;
+		MapLit();
+		~MapLit();
+	};
+	class Subscript: public Base
+	{
+	public:
+		Base* map;
+		Base* key;
+		Subscript(Base* map, Base* key);
+		~Subscript();
+	};
 	class If: public Base
 	{
 	public:
@@ -2,6 +2,7 @@
 #include "node.hpp"
 #include "parser.hpp"
 #include "langs.hpp"
+#include "memory.hpp"
 using namespace Node;
 Parser::Parser(Lexer* lexer, VM* vm, Lang lang)
 {
@@ -23,6 +24,26 @@ void Parser::advance()
 	{
 		// Error here
 	}
+	if (IS_OBJ(this->curr.value))
+	{
+		this->literals.push_back(this->curr.value);
+	}
+}
+void Parser::mark_roots()
+{
+	for (auto &literal : this->literals)
+	{
+		mark_val(literal);
+	}
+}
+void Parser::release_literals()
+{
+	this->literals.clear();
+	// The lookahead belongs to the next statement:
+	if (IS_OBJ(this->curr.value))
+	{
+		this->literals.push_back(this->curr.value);
+	}
 }
 bool Parser::sniff(TokenType type)
 {
@@ -146,6 +167,26 @@ Base* Parser::call_to(Base* node)
 		{
 			result = this->finish_call(result);
 		}
+		else if (this->taste(TOKEN_LBRACK))
+		{
+			this->skip_breaks();
+			auto key = this->expr();
+			this->skip_breaks();
+			this->eat(TOKEN_RBRACK, (const char*[]) {
+				[EN] = "Expected `]`",
+				[ES] = "Se esperó `]`",
+			});
+			result = new Subscript(result, key);
+		}
+		// a.b is a["b"]:
+		else if (this->taste(TOKEN_DOT))
+		{
+			this->eat(TOKEN_ID, (const char*[]) {
+				[EN] = "Expected identifier",
+				[ES] = "Se esperó un identificador",
+			});
+			result = new Subscript(result, this->name_key());
+		}
 		else
 		{
 			break;
@@ -153,6 +194,48 @@ Base* Parser::call_to(Base* node)
 	}
 	return result;
 }
+// The name just read, as the string a map is indexed with:
+Base* Parser::name_key()
+{
+	auto key = copy_string(this->vm, this->prev.start, this->prev.length);
+	this->prev.value = OBJ_VAL((Obj*)key);
+	this->literals.push_back(this->prev.value);
+	return new Const(&this->prev);
+}
+// {key: value, ...}, after the `{`. A bare name is a key in its own right;
+// any other expression is worked out for the key, so (name) looks one up:
+Base* Parser::map_lit()
+{
+	auto result = new MapLit;
+	do
+	{
+		this->skip_breaks();
+		if (this->sniff(TOKEN_RBRACE))
+		{
+			break;
+		}
+		if (this->taste(TOKEN_ID))
+		{
+			result->keys.push_back(this->name_key());
+		}
+		else
+		{
+			result->keys.push_back(this->expr());
+		}
+		this->eat(TOKEN_COLON, (const char*[]) {
+			[EN] = "Expected `:`",
+			[ES] = "Se esperó `:`",
+		});
+		this->skip_breaks();
+		result->values.push_back(this->expr());
+		this->skip_breaks();
+	} while (this->taste(TOKEN_COMMA));
+	this->eat(TOKEN_RBRACE, (const char*[]) {
+		[EN] = "Expected `}`",
+		[ES] = "Se esperó `}`",
+	});
+	return result;
+}
 
 Base* Parser::factor()
 {
@@ -235,7 +318,12 @@ Base* Parser::factor()
 	}
 	else if (this->taste(TOKEN_SUB))
 	{
-		result = new Unary(this->prev.type, this->factor());
+		auto op = this->prev.type;
+		result = new Unary(op, this->factor());
+	}
+	else if (this->taste(TOKEN_LBRACE))
+	{
+		result = this->map_lit();
 	}
 	else if (this->taste(TOKEN_LPAREN))
 	{
@@ -300,7 +388,8 @@ Base* Parser::exp()
 	Base* result = this->factor();
 	if (this->taste(TOKEN_EXP))
 	{
-		result = new Binary(this->prev.type, result, this->exp());
+		auto op = this->prev.type;
+		result = new Binary(op, result, this->exp());
 	}
 	return result;
 }
@@ -313,7 +402,8 @@ Base* Parser::mul()
 		this->taste(TOKEN_DIV) ||
 		this->taste(TOKEN_PER))
 	{
-		result = new Binary(this->prev.type, result, this->exp());
+		auto op = this->prev.type;
+		result = new Binary(op, result, this->exp());
 	}
 	return result;
 }
@@ -324,7 +414,8 @@ Base* Parser::add()
 		this->taste(TOKEN_ADD) ||
 		this->taste(TOKEN_SUB))
 	{
-		result = new Binary(this->prev.type, result, this->mul());
+		auto op = this->prev.type;
+		result = new Binary(op, result, this->mul());
 	}
 	return result;
 }
@@ -334,7 +425,8 @@ Base* Parser::band()
 	while (
 		this->taste(TOKEN_BAND))
 	{
-		result = new Binary(this->prev.type, result, this->add());
+		auto op = this->prev.type;
+		result = new Binary(op, result, this->add());
 	}
 	return result;
 }
@@ -345,7 +437,8 @@ Base* Parser::shift()
 		this->taste(TOKEN_LSHIFT) ||
 		this->taste(TOKEN_RSHIFT))
 	{
-		result = new Binary(this->prev.type, result, this->band());
+		auto op = this->prev.type;
+		result = new Binary(op, result, this->band());
 	}
 	return result;
 }
@@ -355,7 +448,8 @@ Base* Parser::xor_()
 	while (
 		this->taste(TOKEN_TIL))
 	{
-		result = new Binary(this->prev.type, result, this->shift());
+		auto op = this->prev.type;
+		result = new Binary(op, result, this->shift());
 	}
 	return result;
 }
@@ -365,7 +459,8 @@ Base* Parser::bor()
 	while (
 		this->taste(TOKEN_BOR))
 	{
-		result = new Binary(this->prev.type, result, this->xor_());
+		auto op = this->prev.type;
+		result = new Binary(op, result, this->xor_());
 	}
 	return result;
 }
@@ -401,7 +496,8 @@ Base* Parser::and_()
 	auto result = this->comp();
 	while (this->taste(TOKEN_AMP_AMP))
 	{
-		result = new Cond(this->prev.type, result, this->comp());
+		auto op = this->prev.type;
+		result = new Cond(op, result, this->comp());
 	}
 	return result;
 }
@@ -410,7 +506,8 @@ Base* Parser::or_()
 	auto result = this->and_();
 	while (this->taste(TOKEN_PIP_PIP))
 	{
-		result = new Cond(this->prev.type, result, this->and_());
+		auto op = this->prev.type;
+		result = new Cond(op, result, this->and_());
 	}
 	return result;
 }
@@ -453,7 +550,8 @@ Base* Parser::ass()
 		auto value = this->ass();
 		switch (result->type)
 		{
-			case NODE_GET: break;
+			case NODE_GET:
+			case NODE_SUBSCRIPT: break;
 			default:
 			{
 				this->error((const char*[]) {
@@ -13,6 +13,9 @@ private:
 	
 	Lang lang;
 
+	// Objects the lexer made for tokens not yet compiled into a chunk:
+	std::vector<Value> literals;
+
 	bool errored;
 	bool panic;
 	void error(const char* msg[]);
@@ -28,6 +31,8 @@ private:
 	Node::Base* func_body();
 	Node::Base* finish_call(Node::Base* node);
 	Node::Base* call_to(Node::Base* node);
+	Node::Base* name_key();
+	Node::Base* map_lit();
 
 	Node::Base* factor();
 	Node::Base* exp();
@@ -52,5 +57,7 @@ public:
 	Parser(Lexer* lexer, VM* vm, Lang lang);
 	Node::Base* parse();
 	bool panicking();
+	void mark_roots();
+	void release_literals();
 };
 #endif
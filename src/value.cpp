@@ -1,12 +1,13 @@
 #include "value.hpp"
 #include "memory.hpp"
 #include "vm.hpp"
+#include "hash.hpp"
 #include <stdlib.h>
 #include <stdio.h>
 #include <stddef.h>
 void print_val(Value val)
 {
-	switch (val.type)
+	switch (VALUE_TYPE(val))
 	{
 		case VALUE_INT:
 			printf("%ld", AS_INT(val));
@@ -23,10 +24,14 @@ void print_val(Value val)
 		case VALUE_NULL:
 			printf("null");
 			break;
+		case VALUE_UNDEFINED:
+			printf("undefined");
+			break;
 	}
 }
-void print_obj(Value val)
+void print_obj(Obj* obj)
 {
+	auto val = OBJ_VAL(obj);
 	switch (OBJ_TYPE(val))
 	{
 		case OBJ_STRING:
@@ -41,36 +46,55 @@ void print_obj(Value val)
 		case OBJ_CLOSURE:
 			printf("<closure>");
 			break;
+		case OBJ_MAP:
+			printf("<map>");
+			break;
+		case OBJ_SHAPE:
+			printf("<shape>");
+			break;
+		case OBJ_ROPE:
+		{
+			auto len = STRING_LEN(obj);
+			auto chars = (char*)malloc(len + 1);
+			copy_chars(chars, obj);
+			chars[len] = '\0';
+			printf("‘%s’", chars);
+			free(chars);
+			break;
+		}
 	}
 }
 static Obj* allocate_object(VM* vm, size_t size, ObjType type)
 {
-  auto object = (Obj*)reallocate(NULL, 0, size);
-
-  object->type   = type;
-  object->marked = false;
-  object->next   = vm->objects;
-
-  vm->objects = object;
+  // Objects made while the script runs start out young; the compiler's go
+  // straight to the old heap, as do shapes, which must never move, and any
+  // object too big for the nursery:
+  Obj* object = NULL;
+  if (vm->num_frames > 0 && type != OBJ_SHAPE)
+  {
+    object = (Obj*)nursery_alloc(vm, size);
+  }
+  if (object != NULL)
+  {
+    object->young = true;
+  }
+  else
+  {
+    object = (Obj*)pool_alloc(vm, size);
+    object->young = false;
+  }
+  object->type       = type;
+  object->remembered = false;
 	
+  #ifdef LOG_GC
   printf("%p allocate %zu for %d\n", (void*)object, size, type);
+  #endif
 
   return object;
 }
 
 #define ALLOCATE_OBJ(vm, type, objectType) \
     (type*)allocate_object(vm, sizeof(type), objectType)
-static uint32_t hash_string(const char* chars, int len)
-{
-	uint32_t hash = 2166136261u;
-
-	for (int i = 0; i < len; ++i)
-	{
-		hash ^= chars[i];
-		hash *= 16777619;
-	}
-	return hash;
-}
 Native* new_native(VM* vm, NativeFunc func)
 {
 	auto native = ALLOCATE_OBJ(vm, Native, OBJ_NATIVE);
@@ -100,139 +124,677 @@ Upvalue* new_upvalue(struct VM* vm, Value* slot)
 
 Closure* new_closure(VM* vm, Function* func)
 {
-	auto upvalues = ALLOCATE(Upvalue*, func->num_upvalues);
+	auto closure = (Closure*)allocate_object(
+		vm, CLOSURE_SIZE(func->num_upvalues), OBJ_CLOSURE);
+	closure->func = func;
+	closure->num_upvalues = func->num_upvalues;
 	for (int i = 0; i < func->num_upvalues; ++i)
 	{
-		upvalues[i] = NULL;
+		closure->upvalues[i] = NULL;
 	}
-	auto closure = ALLOCATE_OBJ(vm, Closure, OBJ_CLOSURE);
-	closure->func = func;
-	closure->upvalues = upvalues;
-	closure->num_upvalues = func->num_upvalues;
 	return closure;
 }
 
-static ObjString* new_string(
-		VM* vm, char* chars, int length, uint32_t hash)
-{
-	ObjString* string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
-	string->len   = length;
-	string->chars = chars;
-	string->hash  = hash;
-	put_map(&vm->strings, string, NULL_VAL);
-	return string;
-}
 ObjString* copy_string(VM* vm, const char* chars, int length)
 {
 	auto hash = hash_string(chars, length);
 	auto interned = map_find_str(&vm->strings, chars, length, hash);
 	if (interned != NULL)
 	{
+		INTERN_BARRIER(vm, interned);
 		return interned;
 	}
-	auto heap = ALLOCATE(char, length + 1);
-	memcpy(heap, chars, length);
-	heap[length] = '\0';
-	return new_string(vm, heap, length, hash);
+	auto string = make_string(vm, length);
+	memcpy(string->chars, chars, length);
+	string->hash     = hash;
+	string->interned = true;
+	vm->push(OBJ_VAL(string));
+	put_map(&vm->strings, string, NULL_VAL);
+	vm->pop();
+	return string;
 }
-ObjString* take_string(VM* vm, char* chars, int len)
+// Makes a string with room for len chars, for the caller to fill in; it
+// is left to whoever needs it to intern it:
+ObjString* make_string(VM* vm, int len)
 {
-	auto hash = hash_string(chars, len);
-	auto interned = map_find_str(&vm->strings, chars, len, hash);
+	auto string = (ObjString*)allocate_object(vm, STRING_SIZE(len), OBJ_STRING);
+	string->len      = len;
+	string->hash     = 0;
+	string->interned = false;
+	string->chars[len] = '\0';
+	return string;
+}
+// Returns the interned string with the same contents, which is string
+// itself unless the table already had one:
+ObjString* intern_string(VM* vm, ObjString* string)
+{
+	if (string->interned)
+	{
+		return string;
+	}
+	auto hash = hash_string(string->chars, string->len);
+	auto interned = map_find_str(&vm->strings, string->chars, string->len, hash);
 	if (interned != NULL)
 	{
+		INTERN_BARRIER(vm, interned);
 		return interned;
 	}
-	return new_string(vm, chars, len, hash);
+	string->hash     = hash;
+	string->interned = true;
+	vm->push(OBJ_VAL(string));
+	put_map(&vm->strings, string, NULL_VAL);
+	vm->pop();
+	return string;
 }
 
-Map* new_map(VM* vm)
+static uint32_t rope_depth(Obj* string)
 {
-	Map* map = ALLOCATE_OBJ(vm, Map, OBJ_MAP);
-	init_map(map);
+	return string->type == OBJ_ROPE ? ((Rope*)string)->depth : 0;
+}
+// Makes a rope of the strings at halves[0] and halves[1]; they stay there,
+// rooted, while it is allocated, and are read again afterwards:
+Rope* new_rope(VM* vm, Value* halves)
+{
+	auto rope = ALLOCATE_OBJ(vm, Rope, OBJ_ROPE);
+	auto left  = AS_OBJ(halves[0]);
+	auto right = AS_OBJ(halves[1]);
+	rope->len   = STRING_LEN(left) + STRING_LEN(right);
+	auto depth  = rope_depth(left) > rope_depth(right) ? rope_depth(left) : rope_depth(right);
+	rope->depth = depth + 1;
+	rope->left  = left;
+	rope->right = right;
+	return rope;
+}
+// Writes out a string's chars; a rope's depth bounds the recursion:
+void copy_chars(char* dst, Obj* string)
+{
+	while (string->type == OBJ_ROPE)
+	{
+		auto rope = (Rope*)string;
+		copy_chars(dst, rope->left);
+		dst += STRING_LEN(rope->left);
+		string = rope->right;
+	}
+	memcpy(dst, ((ObjString*)string)->chars, STRING_LEN(string));
+}
+// Replaces a rope at *slot with a flat copy, which is returned; *slot keeps
+// the rope rooted while the copy is made:
+ObjString* flatten(VM* vm, Value* slot)
+{
+	if (!IS_ROPE(*slot))
+	{
+		return AS_STRING(*slot);
+	}
+	auto flat = make_string(vm, STRING_LEN(AS_OBJ(*slot)));
+	copy_chars(flat->chars, AS_OBJ(*slot));
+	*slot = OBJ_VAL((Obj*)flat);
+	return flat;
+}
+// Compares two strings' chars without touching the heap, writing a rope's
+// out to a scratch buffer:
+bool equal_chars(Obj* a, Obj* b)
+{
+	auto len = STRING_LEN(a);
+	if (len != STRING_LEN(b))
+	{
+		return false;
+	}
+	char* x = a->type == OBJ_ROPE ? (char*)malloc(len) : ((ObjString*)a)->chars;
+	char* y = b->type == OBJ_ROPE ? (char*)malloc(len) : ((ObjString*)b)->chars;
+	if (a->type == OBJ_ROPE)
+	{
+		copy_chars(x, a);
+	}
+	if (b->type == OBJ_ROPE)
+	{
+		copy_chars(y, b);
+	}
+	auto equal = memcmp(x, y, len) == 0;
+	if (a->type == OBJ_ROPE)
+	{
+		free(x);
+	}
+	if (b->type == OBJ_ROPE)
+	{
+		free(y);
+	}
+	return equal;
+}
+ObjMap* new_map(VM* vm)
+{
+	auto map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+	map->shape  = vm->root_shape;
+	map->cap    = 0;
+	map->values = NULL;
+	map->table  = NULL;
 	return map;
 }
+// Makes the shape with parent's keys and then key, or the root shape if
+// there is no parent. Nothing reaches it while its slots are filled in, so
+// nothing may collect meanwhile:
+Shape* new_shape(VM* vm, Shape* parent, ObjString* key)
+{
+	auto shape = ALLOCATE_OBJ(vm, Shape, OBJ_SHAPE);
+	++vm->num_shapes;
+	shape->key          = key;
+	shape->children     = NULL;
+	shape->sibling      = NULL;
+	shape->num_children = 0;
+	init_map(&shape->slots);
+	if (parent == NULL)
+	{
+		return shape;
+	}
+	++vm->gc_defer;
+	copy_map(&parent->slots, &shape->slots);
+	put_map(&shape->slots, key, INT_VAL((int64_t)parent->slots.len));
+	--vm->gc_defer;
+	for (uint64_t i = 0; i < shape->slots.cap; ++i)
+	{
+		auto slot_key = shape->slots.entries[i].key;
+		if (slot_key != NULL)
+		{
+			WRITE_BARRIER(vm, (Obj*)shape, OBJ_VAL((Obj*)slot_key));
+		}
+	}
+	return shape;
+}
+static Shape* find_child(Shape* shape, ObjString* key)
+{
+	for (auto child = shape->children; child != NULL; child = child->sibling)
+	{
+		if (child->key == key)
+		{
+			return child;
+		}
+	}
+	return NULL;
+}
+// The shape that adding key to shape leads to, made the first time it is
+// needed; NULL if shape has as many keys or children as it may, or the
+// budget for shapes is spent:
+static Shape* add_key(VM* vm, Shape* shape, ObjString* key)
+{
+	auto found = find_child(shape, key);
+	if (found != NULL)
+	{
+		return found;
+	}
+	if (
+		shape->slots.len >= SHAPE_MAX ||
+		shape->num_children >= SHAPE_FANOUT ||
+		vm->num_shapes >= SHAPE_BUDGET)
+	{
+		return NULL;
+	}
+	auto child = new_shape(vm, shape, key);
+	child->sibling = shape->children;
+	// The helper thread may be tracing the parent, and will not trace the
+	// child, born black, through to the sibling it displaces:
+	auto locked = vm->gc_phase == GC_MARK_CONCURRENT;
+	if (locked)
+	{
+		lock_heap(vm);
+	}
+	shape->children = child;
+	++shape->num_children;
+	if (locked)
+	{
+		unlock_heap(vm);
+		satb_log(vm, (Obj*)child->sibling);
+	}
+	WRITE_BARRIER(vm, (Obj*)shape, OBJ_VAL((Obj*)child));
+	return child;
+}
+void init_cache(PropCache* cache)
+{
+	for (int i = 0; i < CACHE_WAYS; ++i)
+	{
+		cache->shapes[i] = NULL;
+		cache->keys[i]   = NULL;
+		cache->next[i]   = NULL;
+		cache->slots[i]  = 0;
+	}
+}
+static int find_way(PropCache* cache, Shape* shape, ObjString* key)
+{
+	if (cache == NULL)
+	{
+		return -1;
+	}
+	for (int i = 0; i < CACHE_WAYS; ++i)
+	{
+		if (cache->shapes[i] == shape && cache->keys[i] == key)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+// Puts a way in front, dropping the least recent one:
+static void fill_cache(PropCache* cache, Shape* shape, ObjString* key, Shape* next, uint64_t slot)
+{
+	if (cache == NULL || key->header.young)
+	{
+		return;
+	}
+	for (int i = CACHE_WAYS - 1; i > 0; --i)
+	{
+		cache->shapes[i] = cache->shapes[i - 1];
+		cache->keys[i]   = cache->keys[i - 1];
+		cache->next[i]   = cache->next[i - 1];
+		cache->slots[i]  = cache->slots[i - 1];
+	}
+	cache->shapes[0] = shape;
+	cache->keys[0]   = key;
+	cache->next[0]   = next;
+	cache->slots[0]  = slot;
+}
+// Nothing collects while a map is updated, and if it is old the helper
+// thread, which may be tracing it, is locked out:
+static bool begin_update(VM* vm, Obj* obj)
+{
+	++vm->gc_defer;
+	auto locked = vm->gc_phase == GC_MARK_CONCURRENT && !obj->young;
+	if (locked)
+	{
+		lock_heap(vm);
+	}
+	return locked;
+}
+static void end_update(VM* vm, bool locked)
+{
+	if (locked)
+	{
+		unlock_heap(vm);
+	}
+	--vm->gc_defer;
+}
+// Stores into one of a map's values; one past the end also moves the map
+// on to the next shape:
+static void store_slot(VM* vm, ObjMap* map, Shape* next, uint64_t slot, Value value)
+{
+	auto locked = begin_update(vm, (Obj*)map);
+	if (slot >= map->cap)
+	{
+		auto old_cap = map->cap;
+		map->cap    = GROW(old_cap);
+		map->values = GROW_ARRAY(Value, map->values, old_cap, map->cap);
+	}
+	auto old = next == NULL ? map->values[slot] : NULL_VAL;
+	map->values[slot] = value;
+	if (next != NULL)
+	{
+		map->shape = next;
+	}
+	end_update(vm, locked);
+	if (locked && IS_OBJ(old))
+	{
+		satb_log(vm, AS_OBJ(old));
+	}
+	WRITE_BARRIER(vm, (Obj*)map, value);
+}
+// Gives a map's shape up for a table of its own, which no longer keeps
+// the keys in order:
+static void to_table(VM* vm, ObjMap* map)
+{
+	auto shape  = map->shape;
+	auto locked = begin_update(vm, (Obj*)map);
+	auto table  = ALLOCATE(Map, 1);
+	init_map(table);
+	for (uint64_t i = 0; i < shape->slots.cap; ++i)
+	{
+		auto entry = &shape->slots.entries[i];
+		if (entry->key != NULL)
+		{
+			put_map(table, entry->key, map->values[AS_INT(entry->value)]);
+		}
+	}
+	FREE_ARRAY(Value, map->values, map->cap);
+	map->values = NULL;
+	map->cap    = 0;
+	map->shape  = NULL;
+	map->table  = table;
+	end_update(vm, locked);
+	for (uint64_t i = 0; i < table->cap; ++i)
+	{
+		if (table->entries[i].key != NULL)
+		{
+			WRITE_BARRIER(vm, (Obj*)map, OBJ_VAL((Obj*)table->entries[i].key));
+		}
+	}
+}
+// Keys must be interned. With a cache, a site that meets a shape it has
+// seen before finds the key's slot without probing:
+bool get_prop(ObjMap* map, ObjString* key, PropCache* cache, Value* value)
+{
+	auto shape = map->shape;
+	if (shape == NULL)
+	{
+		return get_map(map->table, key, value);
+	}
+	auto way = find_way(cache, shape, key);
+	if (way >= 0)
+	{
+		if (cache->next[way] != NULL)
+		{
+			return false;
+		}
+		*value = map->values[cache->slots[way]];
+		return true;
+	}
+	Value slot;
+	if (!get_map(&shape->slots, key, &slot))
+	{
+		return false;
+	}
+	fill_cache(cache, shape, key, NULL, AS_INT(slot));
+	*value = map->values[AS_INT(slot)];
+	return true;
+}
+// Sets args[0][args[1]] to args[2]; they stay rooted there throughout:
+void set_prop(VM* vm, Value* args, PropCache* cache)
+{
+	auto map   = AS_MAP(args[0]);
+	auto key   = AS_STRING(args[1]);
+	auto shape = map->shape;
+	if (shape != NULL)
+	{
+		Shape*   next = NULL;
+		uint64_t slot;
+		auto way = find_way(cache, shape, key);
+		if (way >= 0)
+		{
+			next = cache->next[way];
+			slot = cache->slots[way];
+		}
+		else
+		{
+			Value index;
+			if (get_map(&shape->slots, key, &index))
+			{
+				slot = AS_INT(index);
+			}
+			else
+			{
+				next = add_key(vm, shape, key);
+				slot = shape->slots.len;
+			}
+			if (next != NULL || slot < shape->slots.len)
+			{
+				fill_cache(cache, shape, key, next, slot);
+			}
+		}
+		if (next != NULL || slot < shape->slots.len)
+		{
+			store_slot(vm, map, next, slot, args[2]);
+			return;
+		}
+		to_table(vm, map);
+	}
+	auto locked = begin_update(vm, (Obj*)map);
+	Value old = NULL_VAL;
+	get_map(map->table, key, &old);
+	put_map(map->table, key, args[2]);
+	end_update(vm, locked);
+	if (locked && IS_OBJ(old))
+	{
+		satb_log(vm, AS_OBJ(old));
+	}
+	WRITE_BARRIER(vm, (Obj*)map, args[1]);
+	WRITE_BARRIER(vm, (Obj*)map, args[2]);
+}
+// Puts count pairs of keys and values, from pairs on, into the literal's
+// map at slot, its values grown once to fit them all and its shape followed
+// along the transitions, with no probing unless a key repeats. Keys must
+// be interned; the map and pairs stay rooted where they are throughout:
+void fill_map(VM* vm, Value* slot, Value* pairs, int count)
+{
+	auto map = AS_MAP(*slot);
+	int  i   = 0;
+	// An old map (too rare to be worth it) would have to be locked, and
+	// making shapes locks the heap too:
+	if (count > 0 && map->header.young && map->shape != NULL)
+	{
+		auto cap = map->shape->slots.len + count;
+		if (cap > map->cap)
+		{
+			map->values = GROW_ARRAY(Value, map->values, map->cap, cap);
+			map->cap    = cap;
+		}
+		for (; i < count; ++i)
+		{
+			auto shape = map->shape;
+			auto key   = AS_STRING(pairs[2 * i]);
+			auto next  = find_child(shape, key);
+			Value index;
+			if (next == NULL && get_map(&shape->slots, key, &index))
+			{
+				map->values[AS_INT(index)] = pairs[2 * i + 1];
+				continue;
+			}
+			if (next == NULL && (next = add_key(vm, shape, key)) == NULL)
+			{
+				break;
+			}
+			// Young, so no barrier:
+			map->values[shape->slots.len] = pairs[2 * i + 1];
+			map->shape = next;
+		}
+	}
+	for (; i < count; ++i)
+	{
+		vm->push(*slot);
+		vm->push(pairs[2 * i]);
+		vm->push(pairs[2 * i + 1]);
+		set_prop(vm, vm->top - 3, NULL);
+		vm->top -= 3;
+	}
+}
 void init_map(Map* map)
 {
 	map->len     = 0;
+	map->tombs   = 0;
 	map->cap     = 0;
 	map->entries = NULL;
+	map->ctrl    = NULL;
+}
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xFE
+#define CTRL_HASH(hash) ((hash) & 0x7F)
+// Bit i is set for each of a group's control bytes i that equals byte, or
+// that has its high bit set (is empty or deleted):
+#if defined(__SSE2__) && !defined(NO_SIMD)
+#include <emmintrin.h>
+static inline uint32_t match_ctrl(uint8_t* group, uint8_t byte)
+{
+	auto ctrl = _mm_loadu_si128((__m128i*)group);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+}
+static inline uint32_t match_free(uint8_t* group)
+{
+	return _mm_movemask_epi8(_mm_loadu_si128((__m128i*)group));
 }
-static MapEntry* find_map_entry(MapEntry* entries, int cap, ObjString* key)
+#else
+static inline uint32_t match_ctrl(uint8_t* group, uint8_t byte)
 {
-	uint32_t index = key->hash % cap;
-	MapEntry* tombstone = NULL;
-	for (;;)
+	uint32_t bits = 0;
+	for (int i = 0; i < MAP_GROUP; ++i)
 	{
-		auto entry = &entries[index];
-		if (entry->key == NULL)
+		bits |= (uint32_t)(group[i] == byte) << i;
+	}
+	return bits;
+}
+static inline uint32_t match_free(uint8_t* group)
+{
+	uint32_t bits = 0;
+	for (int i = 0; i < MAP_GROUP; ++i)
+	{
+		bits |= (uint32_t)(group[i] >> 7) << i;
+	}
+	return bits;
+}
+#endif
+// A small map's control bytes, read as one word, with the high bit of each
+// byte that equals byte set; a bit may also be set past a true match, so
+// every hit is checked against the entry:
+#define SMALL_ONES  0x0101010101010101ull
+#define SMALL_HIGHS 0x8080808080808080ull
+static inline uint64_t match_small(uint8_t* ctrl, uint8_t byte)
+{
+	uint64_t word;
+	memcpy(&word, ctrl, MAP_SMALL);
+	word ^= SMALL_ONES * byte;
+	return (word - SMALL_ONES) & ~word & SMALL_HIGHS;
+}
+#define SMALL_INDEX(bits) (__builtin_ctzll(bits) / 8)
+// Probes go a group at a time, starting from the one the hash picks, each
+// step one group further than the last; as the number of groups is a power
+// of two, every group is reached:
+#define FOR_GROUPS(map, hash, group) \
+	for (uint64_t group = ((hash) >> 7) & ((map)->cap / MAP_GROUP - 1), step_ = 1; ; \
+		group = (group + step_++) & ((map)->cap / MAP_GROUP - 1))
+static MapEntry* find_map_entry(Map* map, ObjString* key)
+{
+	if (map->len == 0)
+	{
+		return NULL;
+	}
+	if (map->cap == MAP_SMALL)
+	{
+		for (auto bits = match_small(map->ctrl, CTRL_HASH(key->hash)); bits != 0; bits &= bits - 1)
 		{
-			if (IS_NULL(entry->value))
+			auto entry = &map->entries[SMALL_INDEX(bits)];
+			if (entry->key == key)
 			{
-				return tombstone != NULL ? tombstone : entry;
+				return entry;
 			}
-			else
+		}
+		return NULL;
+	}
+	FOR_GROUPS(map, key->hash, group)
+	{
+		auto ctrl = map->ctrl + group * MAP_GROUP;
+		for (auto bits = match_ctrl(ctrl, CTRL_HASH(key->hash)); bits != 0; bits &= bits - 1)
+		{
+			auto entry = &map->entries[group * MAP_GROUP + __builtin_ctz(bits)];
+			if (entry->key == key)
 			{
-				if (tombstone == NULL)
-				{
-					tombstone = entry;
-				}
+				return entry;
 			}
 		}
-		else if (entry->key == key)
+		if (match_ctrl(ctrl, CTRL_EMPTY) != 0)
 		{
-			return entry;
+			return NULL;
 		}
-
-		index = (index + 1) % cap;
 	}
 }
-static void adjust_cap(Map* map, int cap)
+// The first empty or deleted entry along a hash's probe sequence, or just
+// the first empty one in a small map:
+static uint64_t find_free(Map* map, uint64_t hash)
 {
-	auto entries = ALLOCATE(MapEntry, cap);
-	for (int i = 0; i < cap; ++i)
+	if (map->cap == MAP_SMALL)
 	{
-		entries[i].key = NULL,
-		entries[i].value = NULL_VAL;
+		uint64_t word;
+		memcpy(&word, map->ctrl, MAP_SMALL);
+		return SMALL_INDEX(word & SMALL_HIGHS);
 	}
-	map->len = 0;
-	for (int i = 0; i < map->cap; ++i)
+	FOR_GROUPS(map, hash, group)
 	{
-		auto entry = &map->entries[i];
-		if (entry->key == NULL)
+		auto bits = match_free(map->ctrl + group * MAP_GROUP);
+		if (bits != 0)
 		{
-			continue;
+			return group * MAP_GROUP + __builtin_ctz(bits);
 		}
-		auto dest = find_map_entry(entries, cap, entry->key);
-		dest->key   = entry->key;
-		dest->value = entry->value;
-		++map->len;
 	}
-	
-	FREE_ARRAY(MapEntry, map->entries, map->cap);
-	map->entries = entries;
+}
+static void adjust_cap(Map* map, uint64_t cap)
+{
+	auto old_entries = map->entries;
+	auto old_ctrl    = map->ctrl;
+	auto old_cap     = map->cap;
+	map->entries = (MapEntry*)ALLOCATE(char, cap * (sizeof(MapEntry) + 1));
+	map->ctrl    = (uint8_t*)(map->entries + cap);
 	map->cap     = cap;
+	map->tombs   = 0;
+	for (uint64_t i = 0; i < cap; ++i)
+	{
+		map->entries[i].key   = NULL;
+		map->entries[i].value = NULL_VAL;
+	}
+	memset(map->ctrl, CTRL_EMPTY, cap);
+	for (uint64_t i = 0; i < old_cap; ++i)
+	{
+		if (old_ctrl[i] & 0x80)
+		{
+			continue;
+		}
+		auto index = find_free(map, old_entries[i].key->hash);
+		map->ctrl[index]    = old_ctrl[i];
+		map->entries[index] = old_entries[i];
+	}
+	FREE_ARRAY(char, old_entries, old_cap * (sizeof(MapEntry) + 1));
+}
+// Rehash once live entries and tombstones fill 7/8 of the table:
+#define MAP_FULL(map, count) ((count) * 8 > (map)->cap * 7)
+// The smallest capacity that len entries fill to at most half of the
+// load that triggers a rehash; few enough fit a small map whole:
+static uint64_t fit_cap(uint64_t len)
+{
+	if (len <= MAP_SMALL)
+	{
+		return MAP_SMALL;
+	}
+	uint64_t cap = MAP_GROUP;
+	while (len * 16 > cap * 7)
+	{
+		cap *= 2;
+	}
+	return cap;
 }
+// A small map fills up completely, and then grows into a table. A table's
+// tombstones count towards its load, so that probes stay short after heavy
+// churn; once they fill it, it is rehashed, growing only if the live
+// entries need it. A table clear of tombstones and down to an eighth full
+// shrinks to fit, back to a small map if few enough are left:
 bool put_map(Map* map, ObjString* key, Value value)
 {
-	if (map->len + 1 > map->cap * 0.75)
+	auto entry = find_map_entry(map, key);
+	if (entry != NULL)
+	{
+		entry->value = value;
+		return false;
+	}
+	if (map->cap <= MAP_SMALL)
+	{
+		if (map->len == map->cap)
+		{
+			adjust_cap(map, map->cap == 0 ? MAP_SMALL : MAP_GROUP);
+		}
+	}
+	else if (MAP_FULL(map, map->len + map->tombs + 1))
 	{
-		int cap = GROW(map->cap);
-		adjust_cap(map, cap);
+		auto cap = fit_cap(map->len + 1);
+		adjust_cap(map, cap > map->cap ? cap : map->cap);
 	}
-	auto entry = find_map_entry(map->entries, map->cap, key);
-	auto is_new = entry->key == NULL;
-	if (is_new && IS_NULL(entry->value))
+	else if (map->tombs == 0 && (map->len + 1) * 8 < map->cap && map->cap > MAP_GROUP)
 	{
-		++map->len;
+		adjust_cap(map, fit_cap(map->len + 1));
 	}
-	entry->key   = key;
-	entry->value = value;
-	return is_new;
+	auto index = find_free(map, key->hash);
+	if (map->ctrl[index] == CTRL_DELETED)
+	{
+		--map->tombs;
+	}
+	map->ctrl[index] = CTRL_HASH(key->hash);
+	map->entries[index].key   = key;
+	map->entries[index].value = value;
+	++map->len;
+	return true;
 }
 void copy_map(Map* from, Map* to)
 {
-	for (int i = 0; i < from->cap; ++i)
+	for (uint64_t i = 0; i < from->cap; ++i)
 	{
 		auto entry = &from->entries[i];
 		if (entry->key != NULL)
@@ -241,68 +803,92 @@ void copy_map(Map* from, Map* to)
 		}
 	}
 }
-bool get_map(Map* map, ObjString* key, Value* value)
+// Moves an entry to a key's relocated copy, keeping its position:
+void rekey_map(Map* map, ObjString* from, ObjString* to)
 {
-	if (map->len == 0)
+	auto entry = find_map_entry(map, from);
+	if (entry != NULL)
 	{
-		return false;
+		entry->key = to;
 	}
-	auto entry = find_map_entry(map->entries, map->cap, key);
-	if (entry->key == NULL)
+}
+bool get_map(Map* map, ObjString* key, Value* value)
+{
+	auto entry = find_map_entry(map, key);
+	if (entry == NULL)
 	{
 		return false;
 	}
 	*value = entry->value;
 	return true;
 }
+// Nothing probes past a small map's entries, and a group that still has an
+// empty entry has never been full, so no probe has gone past it either; an
+// entry removed from either can be empty again rather than a tombstone:
 bool rm_map(Map* map, ObjString* key)
 {
-	if (map->len == 0)
+	auto entry = find_map_entry(map, key);
+	if (entry == NULL)
 	{
 		return false;
 	}
-	auto entry = find_map_entry(map->entries, map->cap, key);
-	if (entry->key == NULL)
+	auto index = entry - map->entries;
+	auto group = map->ctrl + index / MAP_GROUP * MAP_GROUP;
+	if (map->cap == MAP_SMALL || match_ctrl(group, CTRL_EMPTY) != 0)
 	{
-		return false;
+		map->ctrl[index] = CTRL_EMPTY;
 	}
-
-	entry->key = NULL;
-	entry->value = BOOL_VAL(true);
-
+	else
+	{
+		map->ctrl[index] = CTRL_DELETED;
+		++map->tombs;
+	}
+	entry->key   = NULL;
+	entry->value = NULL_VAL;
+	--map->len;
 	return true;
 }
 ObjString* map_find_str(
-		Map* map, const char* chars, int len, uint32_t hash)
+		Map* map, const char* chars, int len, uint64_t hash)
 {
 	if (map->len == 0)
 	{
 		return NULL;
 	}
-	uint32_t index = hash % map->cap;
-	for (;;)
+	if (map->cap == MAP_SMALL)
+	{
+		for (auto bits = match_small(map->ctrl, CTRL_HASH(hash)); bits != 0; bits &= bits - 1)
+		{
+			auto key = map->entries[SMALL_INDEX(bits)].key;
+			if (key->hash == hash && key->len == (uint64_t)len &&
+				memcmp(key->chars, chars, len) == 0)
+			{
+				return key;
+			}
+		}
+		return NULL;
+	}
+	FOR_GROUPS(map, hash, group)
 	{
-		auto entry = &map->entries[index];
-		if (entry->key == NULL)
+		auto ctrl = map->ctrl + group * MAP_GROUP;
+		for (auto bits = match_ctrl(ctrl, CTRL_HASH(hash)); bits != 0; bits &= bits - 1)
 		{
-			if (IS_NULL(entry->value))
+			auto key = map->entries[group * MAP_GROUP + __builtin_ctz(bits)].key;
+			if (key->hash == hash && key->len == (uint64_t)len &&
+				memcmp(key->chars, chars, len) == 0)
 			{
-				return NULL;
+				return key;
 			}
 		}
-		else if (
-				entry->key->len  == len &&
-				entry->key->hash == hash &&
-				memcmp(entry->key->chars, chars, len) == 0)
+		if (match_ctrl(ctrl, CTRL_EMPTY) != 0)
 		{
-			return entry->key;
+			return NULL;
 		}
-		index = (index + 1) % map->cap;
 	}
 }
 void free_map(Map* map)
 {
-	FREE_ARRAY(MapEntry, map->entries, map->cap);
+	FREE_ARRAY(char, map->entries, map->cap * (sizeof(MapEntry) + 1));
 	init_map(map);
 }
 
@@ -3,9 +3,10 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include "chunk.hpp"
 
-typedef enum
+typedef enum : uint8_t
 {
 	OBJ_STRING,
 	OBJ_MAP,
@@ -13,13 +14,20 @@ typedef enum
 	OBJ_UPVALUE,
 	OBJ_CLOSURE,
 	OBJ_NATIVE,
+	OBJ_ROPE,
+	OBJ_SHAPE,
 } ObjType;
 
+// Fits in the first word of every object; the heap links objects through
+// its pages, and keeps their mark bits on the side (see vm.hpp):
 typedef struct Obj
 {
-	ObjType     type;
-	struct Obj* next;
-	bool        marked;
+	ObjType type;
+	// Still in the nursery; a forwarded one is marked, with its promoted
+	// copy stored over the first word of its body:
+	bool    young;
+	// Old, and in the remembered set for pointing at young objects:
+	bool    remembered;
 } Obj;
 
 typedef enum
@@ -32,6 +40,14 @@ typedef enum
 	VALUE_UNDEFINED,
 } ValueType;
 
+// Build with -DNAN_BOXING to pack every value into the 8 bytes of a double;
+// ints are then limited to 48 bits.
+#ifdef NAN_BOXING
+typedef struct Value
+{
+	uint64_t bits;
+} Value;
+#else
 typedef struct Value
 {
 	ValueType type;
@@ -43,14 +59,38 @@ typedef struct Value
 		Obj*    obj;
 	} as;
 } Value;
+#endif
 
+// Strings computed at run time stay out of the intern table, and hashless,
+// until intern_string() is asked for the canonical copy; only interned
+// ones may key a map. The chars follow the header in the same allocation;
+// len comes first, so that a forwarded string keeps its hash:
 typedef struct
 {
 	Obj      header;
 	uint64_t len;
-	char*    chars;
-	uint32_t hash;
+	uint64_t hash;
+	bool     interned;
+	char     chars[];
 } ObjString;
+#define STRING_SIZE(len) (offsetof(ObjString, chars) + (len) + 1)
+
+// Concatenation makes a rope of its operands rather than copying them;
+// either half may be a rope itself, and the chars are only written out in
+// one piece when something needs them. Results shorter than ROPE_MIN are
+// copied flat, as is any that would be more than ROPE_DEPTH ropes deep:
+#define ROPE_MIN   64
+#define ROPE_DEPTH 64
+typedef struct
+{
+	Obj      header;
+	uint64_t len;
+	uint32_t depth;
+	struct Obj* left;
+	struct Obj* right;
+} Rope;
+// Flat strings and ropes alike keep their len right after the header:
+#define STRING_LEN(obj) (((ObjString*)(obj))->len)
 
 typedef struct
 {
@@ -58,14 +98,69 @@ typedef struct
 	Value      value;
 } MapEntry;
 
+// A Swiss table: each entry has a control byte, holding the low 7 bits of
+// its key's hash or marking it empty or deleted, and lookups compare the
+// control bytes of MAP_GROUP entries at a time. cap is a power of two, and
+// the control bytes follow the entries in the same allocation. Entries
+// not in use have a NULL key. len counts live entries only; removed ones
+// leave tombstones until the next rehash. A map of up to MAP_SMALL entries
+// is kept whole in a block of that many, with no probing: its control bytes
+// are matched all at once, as one word, and removed entries leave none:
+#define MAP_GROUP 16
+#define MAP_SMALL 8
 typedef struct
 {
-	Obj header;
 	uint64_t len;
+	uint64_t tombs;
 	uint64_t cap;
 	MapEntry* entries;
+	uint8_t*  ctrl;
 } Map;
 
+// A script's map keeps its values in a dense array, in the order their
+// keys were first set; the keys live in its shape, which every map given
+// the same keys in the same order shares. A shape is its parent's keys
+// plus one, with slots mapping each key to its index, and lists the
+// shapes that add one more to it. Shapes are made old and are all
+// reachable from the VM's root shape, so they never move or die, and
+// access sites can cache them. Past SHAPE_MAX keys, or where a shape
+// already has SHAPE_FANOUT children, a map gives its shape up for a table
+// of its own. As each shape copies its parent's slots and none is ever
+// freed, no more are made once there are SHAPE_BUDGET of them, which
+// keeps a script making up keys as it runs from growing the tree forever:
+#define SHAPE_MAX    32
+#define SHAPE_FANOUT 64
+#define SHAPE_BUDGET 4096
+typedef struct Shape
+{
+	Obj           header;
+	ObjString*    key;
+	Map           slots;
+	struct Shape* children;
+	struct Shape* sibling;
+	uint32_t      num_children;
+} Shape;
+typedef struct
+{
+	Obj      header;
+	Shape*   shape;
+	uint64_t cap;
+	Value*   values;
+	Map*     table;
+} ObjMap;
+// An access site's inline cache: the last CACHE_WAYS shapes and keys it
+// met, most recent first, with the slot each key has. A way with a next
+// shape is for a key its shape lacks, which setting moves the map on to.
+// Young keys are never cached, as their addresses get reused:
+#define CACHE_WAYS 4
+typedef struct PropCache
+{
+	Shape*     shapes[CACHE_WAYS];
+	ObjString* keys[CACHE_WAYS];
+	Shape*     next[CACHE_WAYS];
+	uint32_t   slots[CACHE_WAYS];
+} PropCache;
+
 typedef struct
 {
 	Obj header;
@@ -83,13 +178,15 @@ typedef struct Upvalue
 	struct Upvalue* next;
 } Upvalue;
 
+// The upvalues follow the header in the same allocation:
 typedef struct
 {
 	Obj header;
 	Function* func;
-	Upvalue** upvalues;
 	uint64_t num_upvalues;
+	Upvalue* upvalues[];
 } Closure;
+#define CLOSURE_SIZE(num_upvalues) (sizeof(Closure) + (num_upvalues) * sizeof(Upvalue*))
 
 typedef Value (*NativeFunc)(struct VM* vm, int num_args, Value* args);
 
@@ -101,7 +198,9 @@ typedef struct
 
 #define OBJ_TYPE(val) (AS_OBJ(val)->type)
 
-#define IS_STRING(val) isobjtype(val, OBJ_STRING)
+// A flat string or a rope; only a flat one has chars to hand:
+#define IS_STRING(val) (isobjtype(val, OBJ_STRING) || isobjtype(val, OBJ_ROPE))
+#define IS_ROPE(val) isobjtype(val, OBJ_ROPE)
 
 #define IS_MAP(val) isobjtype(val, OBJ_MAP)
 
@@ -110,8 +209,9 @@ typedef struct
 #define IS_CLOSURE(val) isobjtype(val, OBJ_CLOSURE)
 
 #define AS_STRING(val) ((ObjString*)AS_OBJ(val))
+#define AS_ROPE(val) ((Rope*)AS_OBJ(val))
 
-#define AS_MAP(val) ((Map*)AS_OBJ(val))
+#define AS_MAP(val) ((ObjMap*)AS_OBJ(val))
 
 #define AS_FUNC(val) ((Function*)AS_OBJ(val))
 #define AS_NATIVE(val) (((Native*)AS_OBJ(val))->func)
@@ -120,11 +220,72 @@ typedef struct
 #define AS_CSTRING(val) (((ObjString*)AS_OBJ(val))->chars)
 
 
+#ifdef NAN_BOXING
+// Reals are stored as themselves; everything else hides in the payload of a
+// quiet NaN, told apart by the sign bit and the two bits below the quiet bit:
+#define SIGN_BIT     ((uint64_t)0x8000000000000000)
+#define QNAN         ((uint64_t)0x7ffc000000000000)
+#define TAG_MASK     ((uint64_t)0x0003000000000000)
+#define TAG_INT      ((uint64_t)0x0001000000000000)
+#define TAG_SPECIAL  ((uint64_t)0x0002000000000000)
+#define PAYLOAD_MASK ((uint64_t)0x0000ffffffffffff)
+
+#define NULL_BITS      (QNAN | TAG_SPECIAL | 1)
+#define FALSE_BITS     (QNAN | TAG_SPECIAL | 2)
+#define TRUE_BITS      (QNAN | TAG_SPECIAL | 3)
+#define UNDEFINED_BITS (QNAN | TAG_SPECIAL | 4)
+
+static inline Value real_val(double real)
+{
+	Value val;
+	// Canonicalise so that no NaN produced by arithmetic looks like a tag:
+	if (real != real) val.bits = 0x7ff8000000000000;
+	else memcpy(&val.bits, &real, sizeof(double));
+	return val;
+}
+static inline double as_real(Value val)
+{
+	double real;
+	memcpy(&real, &val.bits, sizeof(double));
+	return real;
+}
+
+#define INT_VAL(x)  ((Value) {QNAN | TAG_INT | ((uint64_t)(x) & PAYLOAD_MASK)})
+#define REAL_VAL(x) real_val(x)
+#define BOOL_VAL(x) ((Value) {(x) ? TRUE_BITS : FALSE_BITS})
+#define OBJ_VAL(x)  ((Value) {SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(x)})
+#define NULL_VAL    ((Value) {NULL_BITS})
+#define UNDEFINED_VAL ((Value) {UNDEFINED_BITS})
+
+#define AS_INT(x)  ((int64_t)((x).bits << 16) >> 16)
+#define AS_REAL(x) as_real(x)
+#define AS_BOOL(x) ((x).bits == TRUE_BITS)
+#define AS_OBJ(x)  ((Obj*)(uintptr_t)((x).bits & ~(SIGN_BIT | QNAN)))
+
+#define IS_INT(x)  (((x).bits & (SIGN_BIT | QNAN | TAG_MASK)) == (QNAN | TAG_INT))
+#define IS_REAL(x) (((x).bits & QNAN) != QNAN)
+#define IS_BOOL(x) (((x).bits | 1) == TRUE_BITS)
+#define IS_OBJ(x)  (((x).bits & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN))
+#define IS_NULL(x) ((x).bits == NULL_BITS)
+#define IS_UNDEFINED(x) ((x).bits == UNDEFINED_BITS)
+
+static inline ValueType value_type(Value val)
+{
+	if (IS_REAL(val))  return VALUE_REAL;
+	if (IS_INT(val))   return VALUE_INT;
+	if (IS_OBJ(val))   return VALUE_OBJ;
+	if (IS_BOOL(val))  return VALUE_BOOL;
+	if (IS_NULL(val))  return VALUE_NULL;
+	return VALUE_UNDEFINED;
+}
+#define VALUE_TYPE(x) value_type(x)
+#else
 #define INT_VAL(x)  ((Value) {VALUE_INT,  {.integer=x}})
 #define REAL_VAL(x) ((Value) {VALUE_REAL, {.real=x}})
 #define BOOL_VAL(x) ((Value) {VALUE_BOOL, {.boolean=x}})
 #define OBJ_VAL(x)  ((Value) {VALUE_OBJ,  {.obj=(Obj*)x}})
 #define NULL_VAL    ((Value) {VALUE_NULL, {.integer=0}})
+#define UNDEFINED_VAL ((Value) {VALUE_UNDEFINED, {.integer=0}})
 
 #define AS_INT(x)  ((x).as.integer)
 #define AS_REAL(x) ((x).as.real)
@@ -136,6 +297,10 @@ typedef struct
 #define IS_BOOL(x) ((x).type == VALUE_BOOL)
 #define IS_OBJ(x)  ((x).type == VALUE_OBJ)
 #define IS_NULL(x) ((x).type == VALUE_NULL)
+#define IS_UNDEFINED(x) ((x).type == VALUE_UNDEFINED)
+
+#define VALUE_TYPE(x) ((x).type)
+#endif
 
 void print_val(Value val);
 void print_obj(Obj*  obj);
@@ -150,14 +315,38 @@ Upvalue*  new_upvalue(struct VM* vm, Value* slot);
 Closure*  new_closure(struct VM* vm, Function* func);
 Native*   new_native(struct VM* vm, NativeFunc func);
 ObjString* copy_string(struct VM* vm, const char* chars, int len);
-ObjString* take_string(struct VM* vm, char* chars, int len);
+ObjString* make_string(struct VM* vm, int len);
+ObjString* intern_string(struct VM* vm, ObjString* string);
+Rope*      new_rope(struct VM* vm, Value* halves);
+ObjString* flatten(struct VM* vm, Value* slot);
+void       copy_chars(char* dst, Obj* string);
+bool       equal_chars(Obj* a, Obj* b);
+
+ObjMap* new_map(struct VM* vm);
+Shape*  new_shape(struct VM* vm, Shape* parent, ObjString* key);
+void    init_cache(PropCache* cache);
+bool    get_prop(ObjMap* map, ObjString* key, PropCache* cache, Value* value);
+void    set_prop(struct VM* vm, Value* args, PropCache* cache);
+void    fill_map(struct VM* vm, Value* slot, Value* pairs, int count);
+// get_prop, with a hit on the most recent way inlined:
+static inline bool get_cached(ObjMap* map, ObjString* key, PropCache* cache, Value* value)
+{
+	auto shape = map->shape;
+	if (shape != NULL && cache->shapes[0] == shape && cache->keys[0] == key &&
+		cache->next[0] == NULL)
+	{
+		*value = map->values[cache->slots[0]];
+		return true;
+	}
+	return get_prop(map, key, cache, value);
+}
 
-Map* new_map(struct VM* vm);
 void init_map(Map* map);
 bool put_map(Map* map, ObjString* key, Value value);
 bool get_map(Map* map, ObjString* key, Value* value);
 bool rm_map(Map* map, ObjString* key);
 void copy_map(Map* from, Map* to);
-ObjString* map_find_str(Map* map, const char* chars, int len, uint32_t hash);
+void rekey_map(Map* map, ObjString* from, ObjString* to);
+ObjString* map_find_str(Map* map, const char* chars, int len, uint64_t hash);
 void free_map(Map* map);
 #endif
@@ -6,27 +6,162 @@
 #include <string.h>
 #include "asprintf.hpp"
 #include "native.hpp"
+// Long enough for any int, or a real at 17 significant digits:
+#define FORMAT_MAX 32
+// Maps nested deeper than this, as one holding itself is, print as {…}:
+#define MAP_PRINT_DEPTH 8
+// Writes out a value that is not an object without touching the heap;
+// reals take as few of 15 to 17 significant digits as read back as the
+// same real. Returns the length:
+static int format_val(Value val, char* buf)
+{
+	switch (VALUE_TYPE(val))
+	{
+		case VALUE_INT:
+		{
+			auto integer = AS_INT(val);
+			auto magnitude = integer < 0 ? 0 - (uint64_t)integer : (uint64_t)integer;
+			char digits[20];
+			int num_digits = 0;
+			do
+			{
+				digits[num_digits++] = '0' + magnitude % 10;
+				magnitude /= 10;
+			} while (magnitude != 0);
+			int len = 0;
+			if (integer < 0)
+			{
+				buf[len++] = '-';
+			}
+			while (num_digits > 0)
+			{
+				buf[len++] = digits[--num_digits];
+			}
+			buf[len] = '\0';
+			return len;
+		}
+		case VALUE_REAL:
+		{
+			// 15 digits always survive the trip through a double, and 17 are
+			// always enough to tell any two apart:
+			auto real = AS_REAL(val);
+			int len = 0;
+			for (int digits = 15; digits <= 17; ++digits)
+			{
+				len = snprintf(buf, FORMAT_MAX, "%.*g", digits, real);
+				if (strtod(buf, NULL) == real)
+				{
+					break;
+				}
+			}
+			return len;
+		}
+		case VALUE_BOOL:
+			strcpy(buf, AS_BOOL(val) ? "true" : "false");
+			return (int)strlen(buf);
+		default:
+			strcpy(buf, "null");
+			return 4;
+	}
+}
+static ObjString* format_string(VM* vm, Value val)
+{
+	char buf[FORMAT_MAX];
+	auto len = format_val(val, buf);
+	auto string = make_string(vm, len);
+	memcpy(string->chars, buf, len);
+	return string;
+}
 VM::VM()
 {
 	this->stack         = (Value*)malloc(sizeof(Value)*256);
 	this->top           = this->stack;
 	this->cap           = 0;
 	this->open_upvalues = NULL;
-	this->objects       = NULL;
 	this->num_frames    = 0;
+	this->fuse          = true;
+	this->compiler      = NULL;
+	this->gray          = NULL;
+	this->num_gray      = 0;
+	this->gray_cap      = 0;
+	this->nursery       = (char*)malloc(NURSERY_SIZE);
+	this->nursery_top   = this->nursery;
+	this->nursery_end   = this->nursery + NURSERY_SIZE;
+	this->nursery_marks = (uint64_t*)calloc(NURSERY_SIZE / POOL_GRAIN / 64, sizeof(uint64_t));
+	this->remembered     = NULL;
+	this->num_remembered = 0;
+	this->remembered_cap = 0;
+	this->globals_dirty  = false;
 
+	this->bytes_allocated = 0;
+	this->next_gc         = GC_MIN_HEAP;
+	this->gc_growth       = GC_GROWTH;
+	this->peak_heap       = 0;
+	this->bytes_freed     = 0;
+	this->num_collections = 0;
+	this->num_minor       = 0;
+	this->bytes_promoted  = 0;
+	this->gc_budget       = 0;
+	this->gc_debt         = 0;
+	this->gc_phase        = GC_IDLE;
+	this->sweep_page      = NULL;
+	this->strings_sweep   = NULL;
+	this->strings_swept   = 0;
+	this->max_pause       = 0;
+	this->gc_concurrent   = false;
+	this->marker_started  = false;
+	this->marker_quit     = false;
+	pthread_mutex_init(&this->gc_lock, NULL);
+	pthread_cond_init(&this->gc_wake, NULL);
+	this->gc_waiting      = 0;
+	this->mark_idle       = false;
+	this->satb            = NULL;
+	this->num_satb        = 0;
+	this->satb_cap        = 0;
+	this->gc_verify       = false;
+	this->root_shape      = NULL;
+	this->num_shapes      = 0;
+	this->gc_defer        = 0;
+	for (int i = 0; i < GC_PAUSE_BUCKETS; ++i)
+	{
+		this->pauses[i] = 0;
+	}
+	for (int i = 0; i < SMALL_INTS; ++i)
+	{
+		this->small_ints[i] = NULL;
+	}
+
+	init_pool(&this->pool);
+	bind_vm(this);
 	init_map(&this->strings);
-	init_map(&this->globals);
+	init_ValueArray(&this->globals);
+	init_map(&this->global_slots);
+	this->root_shape = new_shape(this, NULL, NULL);
 
 	this->def_native("print", IO::print);
+	for (int i = 0; i < SMALL_INTS; ++i)
+	{
+		this->small_ints[i] = format_string(this, INT_VAL(i));
+	}
 }
 VM::~VM()
 {
 	puts("freeing vm");
+	stop_marker(this);
+	bind_vm(NULL);
 	free(this->stack);
-	free_map(&this->globals);
+	free(this->gray);
+	free_ValueArray(&this->globals);
+	free_map(&this->global_slots);
 	free_map(&this->strings);
 	free_objects(this);
+	free_pool(&this->pool);
+	free(this->nursery);
+	free(this->nursery_marks);
+	free(this->remembered);
+	free(this->satb);
+	pthread_mutex_destroy(&this->gc_lock);
+	pthread_cond_destroy(&this->gc_wake);
 	puts("freed");
 }
 
@@ -56,9 +191,23 @@ bool VM::call_val(Value callee, uint64_t num_args)
 }
 bool VM::call(Closure* callee, uint64_t num_args)
 {
+	auto chunk = &callee->func->chunk;
+	if (chunk->words == NULL)
+	{
+		decode_Chunk(chunk);
+		if (this->fuse)
+		{
+			fuse_Chunk(chunk);
+		}
+	}
+	if (this->num_frames == MAX_FRAMES)
+	{
+		puts("Stack overflow");
+		exit(0);
+	}
 	auto frame = &this->frames[this->num_frames++];
 	frame->closure = callee;
-	frame->ip      = callee->func->chunk.code;
+	frame->ip      = chunk->words;
 	frame->slots   = this->top - num_args - 1;
 	return true;
 }
@@ -78,7 +227,18 @@ Upvalue* VM::capture_upvalue(Value* local)
 	{
 		return curr;
 	}
+	// Allocating may promote the list's young upvalues, so find the spot
+	// again afterwards:
 	auto created = new_upvalue(this, local);
+	prev = NULL;
+	curr = this->open_upvalues;
+	while (
+		curr != NULL &&
+		curr->loc > local)
+	{
+		prev = curr;
+		curr = curr->next;
+	}
 	created->next = curr;
 	if (prev == NULL)
 	{
@@ -92,6 +252,16 @@ Upvalue* VM::capture_upvalue(Value* local)
 }
 void VM::close_upvalues(Value* last)
 {
+	if (this->open_upvalues == NULL || this->open_upvalues->loc < last)
+	{
+		return;
+	}
+	// The helper thread may be reading the upvalues being closed:
+	auto locked = this->gc_phase == GC_MARK_CONCURRENT;
+	if (locked)
+	{
+		lock_heap(this);
+	}
 	while (
 		this->open_upvalues != NULL &&
 		this->open_upvalues->loc >= last)
@@ -99,18 +269,39 @@ void VM::close_upvalues(Value* last)
 		auto curr = this->open_upvalues;
 		curr->closed = *curr->loc;
 		curr->loc = &curr->closed;
+		WRITE_BARRIER(this, (Obj*)curr, curr->closed);
 		this->open_upvalues = curr->next;
 	}
+	if (locked)
+	{
+		unlock_heap(this);
+	}
+}
+uint64_t VM::global_slot(ObjString* name)
+{
+	Value slot;
+	if (get_map(&this->global_slots, name, &slot))
+	{
+		return AS_INT(slot);
+	}
+	// Unassigned until its DEF_VAR runs:
+	this->push(OBJ_VAL(name));
+	push_ValueArray(&this->globals, UNDEFINED_VAL);
+	put_map(&this->global_slots, name, INT_VAL(this->globals.len - 1));
+	this->pop();
+	return this->globals.len - 1;
 }
 void VM::def_native(const char* name, NativeFunc func)
 {
 	this->push(OBJ_VAL(copy_string(this, name, (int)strlen(name))));
 	this->push(OBJ_VAL(new_native(this, func)));
-	put_map(&this->globals, AS_STRING(this->top[-2]), this->top[-1]);
+	auto slot = this->global_slot(AS_STRING(this->top[-2]));
+	this->globals.values[slot] = this->top[-1];
+	GLOBAL_BARRIER(this, this->top[-1]);
 	/*printf("defined %s\n", name);
 	puts(AS_CSTRING(this->top[-2]));
 	Value foo;
-	printf("%d\n", get_map(&this->globals, AS_STRING(this->top[-2]), &foo));*/
+	printf("%d\n", get_map(&this->global_slots, AS_STRING(this->top[-2]), &foo));*/
 	this->top -= 2;
 }
 Value VM::push(Value val)
@@ -121,23 +312,21 @@ Value VM::pop()
 {
 	return *--this->top;
 }
-char* VM::to_string(Value val)
+char* VM::to_string(Value val, int depth)
 {
 	char* result = NULL;
-	switch (val.type)
+	switch (VALUE_TYPE(val))
 	{
 		case VALUE_INT:
-			asprintf(&result, "%ld", AS_INT(val));
-			break;
 		case VALUE_REAL:
-			asprintf(&result, "%g", AS_REAL(val));
-			break;
 		case VALUE_BOOL:
-			asprintf(&result, "%s", AS_BOOL(val) ? "true" : "false");
-			break;
 		case VALUE_NULL:
-			asprintf(&result, "%s", "null");
+		{
+			char buf[FORMAT_MAX];
+			format_val(val, buf);
+			result = strdup(buf);
 			break;
+		}
 		case VALUE_OBJ:
 		{
 			Obj* obj = AS_OBJ(val);
@@ -146,6 +335,14 @@ char* VM::to_string(Value val)
 				case OBJ_STRING:
 					asprintf(&result, "%s", AS_CSTRING(val));
 					break;
+				case OBJ_ROPE:
+				{
+					auto len = STRING_LEN(obj);
+					result = (char*)malloc(len + 1);
+					copy_chars(result, obj);
+					result[len] = '\0';
+					break;
+				}
 				case OBJ_CLOSURE:
 				case OBJ_FUNCTION:
 					asprintf(&result, "<function>");
@@ -153,10 +350,14 @@ char* VM::to_string(Value val)
 				case OBJ_NATIVE:
 					asprintf(&result, "<native>");
 					break;
+				case OBJ_MAP:
+					result = this->map_to_string(AS_MAP(val), depth);
+					break;
 				default:
 					asprintf(&result, "UNKOWN OBJECT TYPE (LANGUAGE IMPLEMENTOR SCREWED UP!)");
 					break;
 			}
+			break;
 		}
 		default:
 			asprintf(&result, "UNKOWN TYPE (LANGUAGE IMPLEMENTOR SCREWED UP!)");
@@ -164,31 +365,195 @@ char* VM::to_string(Value val)
 	}
 	return result;
 }
+// {key: value, ...}, in the order the keys were first set for as long as
+// the map keeps a shape, with the strings in it quoted:
+char* VM::map_to_string(ObjMap* map, int depth)
+{
+	if (depth >= MAP_PRINT_DEPTH)
+	{
+		return strdup("{…}");
+	}
+	auto table  = map->shape != NULL ? &map->shape->slots : map->table;
+	auto len    = table->len;
+	auto keys   = (ObjString**)malloc(sizeof(ObjString*) * len);
+	auto values = (char**)malloc(sizeof(char*) * len);
+	uint64_t n = 0;
+	for (uint64_t i = 0; i < table->cap; ++i)
+	{
+		auto entry = &table->entries[i];
+		if (entry->key == NULL)
+		{
+			continue;
+		}
+		auto at    = map->shape != NULL ? AS_INT(entry->value) : n;
+		auto value = map->shape != NULL ? map->values[at] : entry->value;
+		keys[at] = entry->key;
+		if (IS_STRING(value))
+		{
+			auto chars = this->to_string(value);
+			asprintf(&values[at], "'%s'", chars);
+			free(chars);
+		}
+		else
+		{
+			values[at] = this->to_string(value, depth + 1);
+		}
+		++n;
+	}
+	size_t size = 3;
+	for (uint64_t i = 0; i < len; ++i)
+	{
+		size += keys[i]->len + strlen(values[i]) + 4;
+	}
+	auto result = (char*)malloc(size);
+	auto dst = result;
+	*dst++ = '{';
+	for (uint64_t i = 0; i < len; ++i)
+	{
+		dst += sprintf(dst, i > 0 ? ", %s: %s" : "%s: %s", keys[i]->chars, values[i]);
+		free(values[i]);
+	}
+	*dst++ = '}';
+	*dst   = '\0';
+	free(keys);
+	free(values);
+	return result;
+}
 Value VM::to_string_val(Value val)
 {
 	if (IS_STRING(val)) return val;
+	if (IS_INT(val) && AS_INT(val) >= 0 && AS_INT(val) < SMALL_INTS)
+	{
+		return OBJ_VAL((Obj*)this->small_ints[AS_INT(val)]);
+	}
+	if (!IS_OBJ(val))
+	{
+		return OBJ_VAL((Obj*)format_string(this, val));
+	}
 	auto chars = this->to_string(val);
-	auto result = take_string(this, chars, strlen(chars));
+	auto len = strlen(chars);
+	auto result = make_string(this, len);
+	memcpy(result->chars, chars, len);
+	free(chars);
 	return OBJ_VAL((Obj*)result);
 }
 void VM::concat()
 {
-	ObjString* b = AS_STRING(this->top[-1]);
-	ObjString* a = AS_STRING(this->top[-2]);
-
-	int length = a->len + b->len;
-	char* chars = ALLOCATE(char, length + 1);
-	memcpy(chars, a->chars, a->len);
-	memcpy(chars + a->len, b->chars, b->len);
-	chars[length] = '\0';
+	auto a = AS_OBJ(this->top[-2]);
+	auto b = AS_OBJ(this->top[-1]);
+	auto length = STRING_LEN(a) + STRING_LEN(b);
+	Obj* result;
+	if (length >= ROPE_MIN &&
+		(a->type != OBJ_ROPE || AS_ROPE(this->top[-2])->depth < ROPE_DEPTH) &&
+		(b->type != OBJ_ROPE || AS_ROPE(this->top[-1])->depth < ROPE_DEPTH))
+	{
+		result = (Obj*)new_rope(this, this->top - 2);
+	}
+	else
+	{
+		// Making the result may move the operands, so they stay on the stack
+		// until it is made:
+		auto flat = make_string(this, length);
+		a = AS_OBJ(this->top[-2]);
+		b = AS_OBJ(this->top[-1]);
+		copy_chars(flat->chars, a);
+		copy_chars(flat->chars + STRING_LEN(a), b);
+		result = (Obj*)flat;
+	}
 	this->top -= 2;
-	ObjString* result = take_string(this, chars, length);
+	*this->top++ = OBJ_VAL(result);
+}
+// Joins the count values atop the stack into one string. Parts that are
+// not strings yet are converted where they lie, so that they stay rooted;
+// a long one in front, as when a string is built up by interpolating it,
+// is joined to the rest as a rope rather than copied:
+void VM::build_string(int count)
+{
+	for (auto i = count; i > 0; --i)
+	{
+		if (!IS_STRING(this->top[-i]))
+		{
+			this->top[-i] = this->to_string_val(this->top[-i]);
+		}
+	}
+	if (count == 2)
+	{
+		this->concat();
+	}
+	if (count <= 2)
+	{
+		return;
+	}
+	auto head = STRING_LEN(AS_OBJ(this->top[-count])) >= ROPE_MIN ? 1 : 0;
+	uint64_t length = 0;
+	for (auto i = count - head; i > 0; --i)
+	{
+		length += STRING_LEN(AS_OBJ(this->top[-i]));
+	}
+	auto result = make_string(this, length);
+	auto dst = result->chars;
+	for (auto i = count - head; i > 0; --i)
+	{
+		auto part = AS_OBJ(this->top[-i]);
+		copy_chars(dst, part);
+		dst += STRING_LEN(part);
+	}
+	this->top -= count - head;
 	*this->top++ = OBJ_VAL((Obj*)result);
+	if (head)
+	{
+		this->concat();
+	}
+}
+// The interned string that indexes a map for the key at slot, which is
+// left there so that it stays rooted:
+ObjString* VM::map_key(Value* slot)
+{
+	if (!IS_STRING(*slot))
+	{
+		puts("Map keys must be strings");
+		exit(0);
+	}
+	auto key = intern_string(this, flatten(this, slot));
+	*slot = OBJ_VAL((Obj*)key);
+	return key;
+}
+// Interns the keys of the count pairs from pairs on where they lie:
+static void map_keys(VM* vm, Value* pairs, int count)
+{
+	for (auto i = 0; i < count; ++i)
+	{
+		auto key = pairs[2 * i];
+		if (!isobjtype(key, OBJ_STRING) || !AS_STRING(key)->interned)
+		{
+			vm->map_key(&pairs[2 * i]);
+		}
+	}
+}
+// Makes a map of the count pairs of keys and values atop the stack, which
+// stay there until it is filled:
+void VM::build_map(int count)
+{
+	auto pairs = this->top - 2 * count;
+	map_keys(this, pairs, count);
+	this->push(OBJ_VAL((Obj*)new_map(this)));
+	fill_map(this, this->top - 1, pairs, count);
+	pairs[0] = this->top[-1];
+	this->top = pairs + 1;
+}
+// Adds the count pairs atop the stack to the map of a literal just below
+// them, which build_map made:
+void VM::extend_map(int count)
+{
+	auto pairs = this->top - 2 * count;
+	map_keys(this, pairs, count);
+	fill_map(this, pairs - 1, pairs, count);
+	this->top = pairs;
 }
 bool VM::equiv(Value a, Value b)
 {
-	#define IS_NUM(x) ((x).type == VALUE_INT || (x).type == VALUE_REAL)
-	if (a.type != b.type)
+	#define IS_NUM(x) (IS_INT(x) || IS_REAL(x))
+	if (VALUE_TYPE(a) != VALUE_TYPE(b))
 	{
 		if (IS_NUM(a) && IS_NUM(b))
 		{
@@ -200,7 +565,7 @@ bool VM::equiv(Value a, Value b)
 		}
 		return false;
 	}
-	switch (a.type)
+	switch (VALUE_TYPE(a))
 	{
 		case VALUE_INT:
 			return AS_INT(a) == AS_INT(b);
@@ -211,7 +576,20 @@ bool VM::equiv(Value a, Value b)
 		case VALUE_NULL:
 			return true; // Sometimes, giving a special value its own type makes sense…
 		case VALUE_OBJ:
-			return AS_OBJ(a) == AS_OBJ(b);
+		{
+			if (AS_OBJ(a) == AS_OBJ(b))
+			{
+				return true;
+			}
+			// Two interned strings are equal only if they are the same one:
+			if (!IS_STRING(a) || !IS_STRING(b) ||
+				(isobjtype(a, OBJ_STRING) && isobjtype(b, OBJ_STRING) &&
+				 AS_STRING(a)->interned && AS_STRING(b)->interned))
+			{
+				return false;
+			}
+			return equal_chars(AS_OBJ(a), AS_OBJ(b));
+		}
 		default: break;
 	}
 	return false;
@@ -227,42 +605,42 @@ bool VM::is_true(Value val)
 
 void VM::run()
 {
-	auto frame = &this->frames[this->num_frames - 1];
-	register uint64_t uleb = 0;
-	register uint8_t* ip = frame->ip;
-	register uint32_t uint = 0;
-	#define READ_BYTE() (*ip++)
+	CallFrame* frame;
+	register Word*  ip;
+	register Value* slots;
+	register Value* consts;
+	PropCache* caches;
+	// Everything the handlers need from the current frame lives in locals:
+	#define LOAD_FRAME() \
+		do \
+		{ \
+			frame  = &this->frames[this->num_frames - 1]; \
+			ip     = frame->ip; \
+			slots  = frame->slots; \
+			consts = frame->closure->func->chunk.consts.values; \
+			caches = frame->closure->func->chunk.caches; \
+		} while (false)
+	LOAD_FRAME();
+	#define READ_WORD() (*ip++)
+	#ifdef COMPUTED_GOTO
+	// One label per opcode, in the same order as the Opcode enum, so every
+	// handler can jump straight to the next one:
+	static void* dispatch_table[] = {
+		#define OP(name, _) &&op_##name
+		#include "opcode.txt"
+		#undef OP
+	};
+	#define INT_LOOP() DISPATCH();
+	#define DISPATCH() goto *dispatch_table[READ_WORD()]
+	#define OP(code) op_##code
+	#else
 	#define INT_LOOP() \
 		interpret: \
-			switch (READ_BYTE())
+			switch (READ_WORD())
 
 	#define DISPATCH() goto interpret
-	#define ULEB() \
-		do { \
-			uleb = 0; \
-			uint8_t shift = 0; \
-			uint8_t val; \
-			for (;;) \
-			{ \
-				val = READ_BYTE(); \
-				uleb |= (uint64_t)(val & 0x7F) << shift; \
-				if ((val & 0x80) == 0) \
-				{ \
-					break; \
-				} \
-				shift += 7; \
-			} \
-		} while (false)
-	#define UINT() \
-		do \
-		{  \
-			ip += 4; \
-			uint = ( \
-				((ip[-4] << 24) & 0xFF) | \
-				((ip[-3] << 16) & 0xFF) | \
-				((ip[-2] <<  8) & 0xFF) | \
-				((ip[-1])       & 0xFF)); \
-		} while (false)
+	#define OP(code) case OP_##code
+	#endif
 
 
 	#define POP() (*--this->top)
@@ -270,9 +648,7 @@ void VM::run()
 	#define PEEK(level) (this->top[-1 - (level)])
 	#define PUT(level, val) (this->top[-1 - (level)] = (val))
 
-	#define COMP(op) do { \
-		auto b = POP(); \
-		auto a = POP(); \
+	#define COMPARE(a, b, op) do { \
 		auto a_type = IS_INT(a) ? VALUE_INT : VALUE_REAL; \
 		auto b_type = IS_INT(b) ? VALUE_INT : VALUE_REAL; \
 		if (a_type == VALUE_REAL) \
@@ -295,6 +671,11 @@ void VM::run()
 			PUSH(BOOL_VAL(AS_INT(a) op AS_INT(b))); \
 		} } while (false)
 
+	#define COMP(op) do { \
+		auto b = POP(); \
+		auto a = POP(); \
+		COMPARE(a, b, op); } while (false)
+
 	#define UNARY(op) do { \
 		auto a = POP(); \
 		auto a_type = IS_INT(a) ? VALUE_INT : VALUE_REAL; \
@@ -311,9 +692,7 @@ void VM::run()
 		auto a = POP(); \
 		PUSH(INT_VAL(op AS_INT(a))); } while (false)
 
-	#define BINARY(op) do { \
-		auto b = POP(); \
-		auto a = POP(); \
+	#define ARITH(a, b, op) do { \
 		auto a_type = IS_INT(a) ? VALUE_INT : VALUE_REAL; \
 		auto b_type = IS_INT(b) ? VALUE_INT : VALUE_REAL; \
 		if (a_type == VALUE_REAL) \
@@ -336,39 +715,129 @@ void VM::run()
 			PUSH(INT_VAL(AS_INT(a) op AS_INT(b))); \
 		} } while (false)
 
+	#define BINARY(op) do { \
+		auto b = POP(); \
+		auto a = POP(); \
+		ARITH(a, b, op); } while (false)
+
 	#define BINARY_INT(op) do { \
 		auto b = POP(); \
 		auto a = POP(); \
 		PUSH(INT_VAL(AS_INT(a) op AS_INT(b))); } while (false)
-	#define CONST(x) frame->closure->func->chunk.consts.values[x]
-	#define OP(code) case OP_##code
+
+	#define COMP_INT(op) do { \
+		auto b = POP(); \
+		auto a = POP(); \
+		PUSH(BOOL_VAL(AS_INT(a) op AS_INT(b))); } while (false)
+
+	#define INT_ARITH(a, b, op) PUSH(INT_VAL(AS_INT(a) op AS_INT(b)))
+	#define INT_COMPARE(a, b, op) PUSH(BOOL_VAL(AS_INT(a) op AS_INT(b)))
+
+	// Type-feedback quickening: a generic instruction that gets two ints
+	// rewrites its own opcode into the int-only form, and that form rewrites
+	// itself back, then reruns as the generic one, the first time it
+	// doesn't. Both expect `ip` just past the opcode.
+	#define INT_OPERANDS(a, b) (IS_INT(a) && IS_INT(b))
+	#define QUICKEN(op) (ip[-1] = OP_##op)
+	#define DEOPT(op) do { \
+		ip[-1] = OP_##op; \
+		--ip; \
+		DISPATCH(); } while (false)
+
+	#define BINARY_OR_QUICKEN(quick, kind, int_kind, op) do { \
+		if (INT_OPERANDS(PEEK(1), PEEK(0))) \
+		{ \
+			QUICKEN(quick); \
+			int_kind(op); \
+		} \
+		else \
+		{ \
+			kind(op); \
+		} } while (false)
+
+	#define INT_ONLY(generic, int_kind, op) do { \
+		if (!INT_OPERANDS(PEEK(1), PEEK(0))) \
+		{ \
+			DEOPT(generic); \
+		} \
+		int_kind(op); } while (false)
+	#define CONST(x) consts[x]
 	puts("running");
 	INT_LOOP()
 	{
 		OP(CALL):
 		{
-			ULEB();
-			auto num_args = uleb;
+			auto num_args = READ_WORD();
 			frame->ip = ip;
 			if (!this->call_val(PEEK(num_args), num_args))
 			{}
-			frame = &this->frames[this->num_frames - 1];
-			ip = frame->ip;
+			LOAD_FRAME();
 			DISPATCH();
 		}
 		OP(POP):
 			POP();
 			DISPATCH();
 		OP(CONST):
-			ULEB();
-			PUSH(CONST(uleb));
+			PUSH(CONST(READ_WORD()));
 			DISPATCH();
 		OP(NULL): // BOY I LOVE SHOUTIN'
 			PUSH(NULL_VAL);
 			DISPATCH();
+		OP(TRUE):
+			PUSH(BOOL_VAL(true));
+			DISPATCH();
+		OP(FALSE):
+			PUSH(BOOL_VAL(false));
+			DISPATCH();
 		OP(CONCAT):
 			concat();
 			DISPATCH();
+		OP(BUILD_STRING):
+			build_string(READ_WORD());
+			DISPATCH();
+		OP(NEW_MAP):
+			build_map(READ_WORD());
+			DISPATCH();
+		OP(EXTEND_MAP):
+			extend_map(READ_WORD());
+			DISPATCH();
+		// Keys are nearly always interned already, being constants or names;
+		// the rest are interned where they lie:
+		#define SUB_KEY(slot) \
+			(isobjtype(slot, OBJ_STRING) && AS_STRING(slot)->interned ? \
+				AS_STRING(slot) : this->map_key(&(slot)))
+		#define SUB_MAP(slot) do { \
+			if (!IS_MAP(slot)) \
+			{ \
+				puts("Only maps can be subscripted"); \
+				exit(0); \
+			} } while (false)
+		OP(SUB_GET):
+		{
+			auto cache = &caches[READ_WORD()];
+			SUB_MAP(PEEK(1));
+			auto key = SUB_KEY(PEEK(0));
+			Value value;
+			if (!get_cached(AS_MAP(PEEK(1)), key, cache, &value))
+			{
+				value = NULL_VAL;
+			}
+			POP();
+			PUT(0, value);
+			DISPATCH();
+		}
+		OP(SUB_SET):
+		{
+			auto cache = &caches[READ_WORD()];
+			SUB_MAP(PEEK(2));
+			SUB_KEY(PEEK(1));
+			set_prop(this, this->top - 3, cache);
+			PUT(2, PEEK(0));
+			this->top -= 2;
+			DISPATCH();
+		}
+		#undef SUB_KEY
+		#undef SUB_MAP
 		OP(TO_STR):
 		{
 			auto str = this->to_string_val(PEEK(0));
@@ -378,8 +847,19 @@ void VM::run()
 		OP(NEG):
 			UNARY(-);
 			DISPATCH();
+		OP(BNOT):
+			UNARY_INT(~);
+			DISPATCH();
+		OP(NOT):
+			PUT(0, BOOL_VAL(!this->is_true(PEEK(0))));
+			DISPATCH();
 		OP(ADD):
-			if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1)))
+			if (INT_OPERANDS(PEEK(1), PEEK(0)))
+			{
+				QUICKEN(ADD_INT);
+				BINARY_INT(+);
+			}
+			else if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1)))
 			{
 				concat();
 			}
@@ -389,13 +869,13 @@ void VM::run()
 			}
 			DISPATCH();
 		OP(SUB):
-			BINARY(-);
+			BINARY_OR_QUICKEN(SUB_INT, BINARY, BINARY_INT, -);
 			DISPATCH();
 		OP(MUL):
-			BINARY(*);
+			BINARY_OR_QUICKEN(MUL_INT, BINARY, BINARY_INT, *);
 			DISPATCH();
 		OP(DIV):
-			BINARY(/);
+			BINARY_OR_QUICKEN(DIV_INT, BINARY, BINARY_INT, /);
 			DISPATCH();
 		OP(MOD):
 			BINARY_INT(%);
@@ -409,47 +889,71 @@ void VM::run()
 		OP(BAND):
 			BINARY_INT(&);
 			DISPATCH();
+		OP(LSHIFT):
+			BINARY_INT(<<);
+			DISPATCH();
+		OP(RSHIFT):
+			BINARY_INT(>>);
+			DISPATCH();
 		OP(EXP):
 			BINARY(-);
 			DISPATCH();
 		OP(LT):
-			COMP(<);
+			BINARY_OR_QUICKEN(LT_INT, COMP, COMP_INT, <);
 			DISPATCH();
 		OP(GT):
-			COMP(>);
+			BINARY_OR_QUICKEN(GT_INT, COMP, COMP_INT, >);
 			DISPATCH();
 		OP(LE):
-			COMP(<=);
+			BINARY_OR_QUICKEN(LE_INT, COMP, COMP_INT, <=);
 			DISPATCH();
 		OP(GE):
-			COMP(>=);
+			BINARY_OR_QUICKEN(GE_INT, COMP, COMP_INT, >=);
+			DISPATCH();
+		OP(ADD_INT):
+			INT_ONLY(ADD, BINARY_INT, +);
+			DISPATCH();
+		OP(SUB_INT):
+			INT_ONLY(SUB, BINARY_INT, -);
+			DISPATCH();
+		OP(MUL_INT):
+			INT_ONLY(MUL, BINARY_INT, *);
+			DISPATCH();
+		OP(DIV_INT):
+			INT_ONLY(DIV, BINARY_INT, /);
+			DISPATCH();
+		OP(LT_INT):
+			INT_ONLY(LT, COMP_INT, <);
+			DISPATCH();
+		OP(GT_INT):
+			INT_ONLY(GT, COMP_INT, >);
+			DISPATCH();
+		OP(LE_INT):
+			INT_ONLY(LE, COMP_INT, <=);
+			DISPATCH();
+		OP(GE_INT):
+			INT_ONLY(GE, COMP_INT, >=);
 			DISPATCH();
 		OP(DEF_VAR):
-		{
-			ULEB();
-			auto name = AS_STRING(CONST(uleb));
-			put_map(&this->globals, name, PEEK(0));
-			POP();
+			GLOBAL_BARRIER(this, PEEK(0));
+			this->globals.values[READ_WORD()] = POP();
 			DISPATCH();
-		}
 		OP(SET_VAR):
 		{
-			ULEB();
-			auto name = AS_STRING(CONST(uleb));
-			if (put_map(&this->globals, name, PEEK(0)))
+			auto global = &this->globals.values[READ_WORD()];
+			if (IS_UNDEFINED(*global))
 			{
-				rm_map(&this->globals, name);
 				puts("Undefined");
 				exit(0);
 			}
+			*global = PEEK(0);
+			GLOBAL_BARRIER(this, PEEK(0));
 			DISPATCH();
 		}
 		OP(GET_VAR):
 		{
-			ULEB();
-			auto name = AS_STRING(CONST(uleb));
-			Value value;
-			if (!get_map(&this->globals, name, &value))
+			auto value = this->globals.values[READ_WORD()];
+			if (IS_UNDEFINED(value))
 			{
 				puts("Undefined variable access");
 				exit(0);
@@ -458,51 +962,64 @@ void VM::run()
 			DISPATCH();
 		}
 		OP(GET_LOCAL):
-			ULEB();
-			PUSH(frame->slots[uleb]);
+			PUSH(slots[READ_WORD()]);
 			DISPATCH();
 		OP(SET_LOCAL):
-			ULEB();
-			frame->slots[uleb] = PEEK(0);
+			slots[READ_WORD()] = PEEK(0);
 			DISPATCH();
 		OP(GET_UPVAL):
-			ULEB();
-			PUSH(*frame->closure->upvalues[uleb]->loc);
+			PUSH(*frame->closure->upvalues[READ_WORD()]->loc);
 			DISPATCH();
 		OP(SET_UPVAL):
-			ULEB();
-			*frame->closure->upvalues[uleb]->loc = PEEK(0);
+		{
+			auto upvalue = frame->closure->upvalues[READ_WORD()];
+			if (this->gc_phase == GC_MARK_CONCURRENT && upvalue->loc == &upvalue->closed)
+			{
+				satb_store(this, upvalue->loc, PEEK(0));
+			}
+			else
+			{
+				*upvalue->loc = PEEK(0);
+			}
+			WRITE_BARRIER(this, (Obj*)upvalue, PEEK(0));
 			DISPATCH();
+		}
 		OP(EQUIV):
-			PUT(0, BOOL_VAL(this->equiv(POP(), PEEK(0))));
+		{
+			auto b = POP();
+			PUT(0, BOOL_VAL(this->equiv(PEEK(0), b)));
 			DISPATCH();
-		OP(GOTO):
-			UINT();
-			ip = frame->closure->func->chunk.code + uint;
+		}
+		OP(NOT_EQUIV):
+		{
+			auto b = POP();
+			PUT(0, BOOL_VAL(!this->equiv(PEEK(0), b)));
 			DISPATCH();
+		}
+		// Jump operands are decoded to offsets from the end of the operand:
+		OP(GOTO):
 		OP(JMP):
-			UINT();
-			ip += uint;
+			ip += *ip + 1;
 			DISPATCH();
 		OP(OR):
-			UINT();
 			if (this->is_true(PEEK(0)))
 			{
-				ip += uint;
+				ip += *ip + 1;
 			}
 			else
 			{
+				++ip;
 				POP();
 			}
 			DISPATCH();
 		OP(AND):
-			UINT();
 			if (!this->is_true(PEEK(0)))
 			{
-				ip += uint;
+				ip += *ip + 1;
 			}
 			else
 			{
+				++ip;
 				POP();
 			}
 			DISPATCH();
@@ -544,23 +1061,29 @@ void VM::run()
 		}
 		OP(CLOSURE):
 		{
-			ULEB();
-			auto func = AS_FUNC(CONST(uleb));
-			auto closure = new_closure(this, func);
-			PUSH(OBJ_VAL(closure));
-			for (int i = 0; i < closure->num_upvalues; ++i)
+			auto func = AS_FUNC(CONST(READ_WORD()));
+			PUSH(OBJ_VAL(new_closure(this, func)));
+			for (uint64_t i = 0; i < func->num_upvalues; ++i)
 			{
-				auto is_local = (bool)READ_BYTE();
-				ULEB();
-				auto index = uleb;
-				if (is_local)
+				auto is_local = (bool)READ_WORD();
+				auto index = READ_WORD();
+				auto upvalue = is_local ?
+					this->capture_upvalue(slots + index) :
+					frame->closure->upvalues[index];
+				// Capturing can promote the closure; reload it:
+				auto closure = AS_CLOSURE(PEEK(0));
+				if (this->gc_phase == GC_MARK_CONCURRENT && !closure->header.young)
 				{
-					closure->upvalues[i] = this->capture_upvalue(frame->slots + index);
+					// Old now, so the helper thread may be tracing it:
+					lock_heap(this);
+					closure->upvalues[i] = upvalue;
+					unlock_heap(this);
 				}
 				else
 				{
-					closure->upvalues[i] = frame->closure->upvalues[index];
+					closure->upvalues[i] = upvalue;
 				}
+				WRITE_BARRIER(this, (Obj*)closure, OBJ_VAL(upvalue));
 			}
 			DISPATCH();
 		}
@@ -580,24 +1103,155 @@ void VM::run()
 			}
 			this->top = frame->slots;
 			PUSH(result);
-			frame = &this->frames[this->num_frames - 1];
-			ip = frame->ip;
+			LOAD_FRAME();
 			DISPATCH();
 		}
+		// Superinstructions, folded together by fuse_Chunk. Each reads a local
+		// and then either another local or a constant, and quickens like the
+		// plain instructions do:
+		#define FUSED(second, quick, kind, int_kind, op) do { \
+			auto a = slots[ip[0]]; \
+			auto b = second[ip[1]]; \
+			if (INT_OPERANDS(a, b)) \
+			{ \
+				QUICKEN(quick); \
+				int_kind(a, b, op); \
+			} \
+			else \
+			{ \
+				kind(a, b, op); \
+			} \
+			ip += 2; } while (false)
+		#define FUSED_INT(second, generic, int_kind, op) do { \
+			auto a = slots[ip[0]]; \
+			auto b = second[ip[1]]; \
+			if (!INT_OPERANDS(a, b)) \
+			{ \
+				DEOPT(generic); \
+			} \
+			ip += 2; \
+			int_kind(a, b, op); } while (false)
+		#define CONCAT_OR_ARITH(a, b, op) do { \
+			if (IS_STRING(a) && IS_STRING(b)) \
+			{ \
+				PUSH(a); \
+				PUSH(b); \
+				concat(); \
+			} \
+			else \
+			{ \
+				ARITH(a, b, op); \
+			} } while (false)
+		OP(ADD_LL):
+			FUSED(slots, ADD_LL_INT, CONCAT_OR_ARITH, INT_ARITH, +);
+			DISPATCH();
+		OP(ADD_LK):
+			FUSED(consts, ADD_LK_INT, CONCAT_OR_ARITH, INT_ARITH, +);
+			DISPATCH();
+		OP(SUB_LK):
+			FUSED(consts, SUB_LK_INT, ARITH, INT_ARITH, -);
+			DISPATCH();
+		OP(LT_LK):
+			FUSED(consts, LT_LK_INT, COMPARE, INT_COMPARE, <);
+			DISPATCH();
+		OP(LE_LK):
+			FUSED(consts, LE_LK_INT, COMPARE, INT_COMPARE, <=);
+			DISPATCH();
+		OP(GT_LK):
+			FUSED(consts, GT_LK_INT, COMPARE, INT_COMPARE, >);
+			DISPATCH();
+		OP(GE_LK):
+			FUSED(consts, GE_LK_INT, COMPARE, INT_COMPARE, >=);
+			DISPATCH();
+		OP(ADD_LL_INT):
+			FUSED_INT(slots, ADD_LL, INT_ARITH, +);
+			DISPATCH();
+		OP(ADD_LK_INT):
+			FUSED_INT(consts, ADD_LK, INT_ARITH, +);
+			DISPATCH();
+		OP(SUB_LK_INT):
+			FUSED_INT(consts, SUB_LK, INT_ARITH, -);
+			DISPATCH();
+		OP(LT_LK_INT):
+			FUSED_INT(consts, LT_LK, INT_COMPARE, <);
+			DISPATCH();
+		OP(LE_LK_INT):
+			FUSED_INT(consts, LE_LK, INT_COMPARE, <=);
+			DISPATCH();
+		OP(GT_LK_INT):
+			FUSED_INT(consts, GT_LK, INT_COMPARE, >);
+			DISPATCH();
+		OP(GE_LK_INT):
+			FUSED_INT(consts, GE_LK, INT_COMPARE, >=);
+			DISPATCH();
+		#undef FUSED
+		#undef FUSED_INT
+		#undef CONCAT_OR_ARITH
+		OP(CASE_K):
+			if (this->equiv(PEEK(0), CONST(READ_WORD())))
+			{
+				PUSH(BOOL_VAL(true));
+				ip += *ip + 1;
+			}
+			else
+			{
+				++ip;
+			}
+			DISPATCH();
+		OP(POPN):
+			this->top -= READ_WORD();
+			DISPATCH();
+		OP(JUMP_IF_FALSE_POP):
+			if (this->is_true(POP()))
+			{
+				++ip;
+			}
+			else
+			{
+				ip += *ip + 1;
+			}
+			DISPATCH();
+		// Reserved, but never emitted by the compiler yet:
+		OP(I_ADD):
+		OP(I_SUB):
+		OP(I_MUL):
+		OP(I_MOD):
+		OP(I_DIV):
+		OP(I_EXP):
+		OP(I_LSHIFT):
+		OP(I_RSHIFT):
+		OP(I_BOR):
+		OP(I_BAND):
+		OP(I_XOR):
+		OP(COAL):
+		OP(OPTIONAL):
+			puts("Unimplemented instruction");
+			exit(0);
 	}
 	
-	#undef READ_BYTE
+	#undef READ_WORD
+	#undef LOAD_FRAME
+	#undef CONST
 	#undef INT_LOOP
 	#undef OP
 	#undef DISPATCH
-	#undef ULEB
 	#undef PUT
 	#undef PUSH
 	#undef PEEK
 	#undef POP
-	#undef UINT
 	#undef BINARY
+	#undef ARITH
+	#undef COMP
+	#undef COMPARE
 	#undef BINARY_INT
+	#undef COMP_INT
+	#undef INT_ARITH
+	#undef INT_COMPARE
+	#undef INT_OPERANDS
+	#undef QUICKEN
+	#undef DEOPT
+	#undef BINARY_OR_QUICKEN
+	#undef INT_ONLY
 	#undef UNARY
 	#undef UNARY_INT
 }
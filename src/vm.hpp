@@ -3,11 +3,68 @@
 #include "chunk.hpp"
 #include "value.hpp"
 #include <stddef.h>
+#include <pthread.h>
+#include <atomic>
 #define MAX_FRAMES 64
+// Threaded dispatch relies on the labels-as-values extension; build with
+// -DNO_COMPUTED_GOTO to fall back to the portable switch.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+// Objects up to POOL_MAX bytes are carved out of POOL_PAGE-sized pages, in
+// size classes POOL_GRAIN bytes apart up to POOL_FINE and POOL_COARSE apart
+// beyond it; each class recycles its slots through a free list. A bigger
+// object gets pages of its own.
+#define POOL_GRAIN   16
+#define POOL_FINE    128
+#define POOL_COARSE  64
+#define POOL_MAX     512
+#define POOL_CLASSES (POOL_FINE / POOL_GRAIN + (POOL_MAX - POOL_FINE) / POOL_COARSE)
+#define POOL_PAGE    4096
+#define POOL_BITS    (POOL_PAGE / POOL_GRAIN / 64)
+typedef struct FreeSlot
+{
+	struct FreeSlot* next;
+} FreeSlot;
+// Pages are POOL_PAGE-aligned, and their first grain points back at a
+// descriptor kept apart from them, with a bit per grain for each slot in
+// use and each slot marked; marking never writes to the pages themselves:
+typedef struct PoolPage
+{
+	struct PoolPage* next;
+	struct PoolPage* prev;
+	char*    base;
+	// The size of its one object, on a page of its own:
+	size_t   large;
+	// From the start of a sweep until this page is swept; objects made on
+	// it meanwhile are born marked:
+	bool     unswept;
+	uint64_t marks[POOL_BITS];
+	uint64_t live[POOL_BITS];
+} PoolPage;
+typedef struct
+{
+	FreeSlot* free[POOL_CLASSES];
+	PoolPage* pages;
+} Pool;
+// An incremental collection marks, then sweeps, a slice at a time; a
+// concurrent one marks on a helper thread:
+typedef enum
+{
+	GC_IDLE,
+	GC_MARK,
+	GC_MARK_CONCURRENT,
+	GC_SWEEP,
+} GCPhase;
+// Pauses are counted in power-of-two microsecond buckets:
+#define GC_PAUSE_BUCKETS 24
+// Strings for the integers below SMALL_INTS are made once, up front:
+#define SMALL_INTS 256
+class Compiler;
 typedef struct
 {
 	Closure* closure;
-	uint8_t*  ip;
+	Word*     ip;
 	Value*    slots;
 } CallFrame;
 class VM
@@ -15,7 +72,8 @@ class VM
 public:
 	static bool  equiv(Value a, Value b);
 	static bool  is_true(Value val);
-	char* to_string(Value val);
+	char* to_string(Value val, int depth = 0);
+	char* map_to_string(ObjMap* map, int depth);
 	Value to_string_val(Value val);
 
 	CallFrame frames[MAX_FRAMES];
@@ -24,19 +82,94 @@ public:
 	Value*    top;
 	int       cap;
 	Upvalue*  open_upvalues;
-	Obj*      objects;
+	Pool      pool;
 	Map       strings;
-	Map       globals;
+	// Globals live in dense slots resolved at compile time; the name table
+	// maps each name to its slot so late definitions find the same one:
+	ValueArray globals;
+	Map       global_slots;
 	Map       const_table;
+	// Marks its in-flight functions while a script is being compiled:
+	Compiler* compiler;
+	// Marked objects whose children are still to be traced:
+	Obj**     gray;
+	int       num_gray;
+	int       gray_cap;
+	// The nursery (see memory.hpp), and the old objects that may point
+	// into it; globals are rescanned whenever one has been given a young
+	// value:
+	char*     nursery;
+	char*     nursery_top;
+	char*     nursery_end;
+	uint64_t* nursery_marks;
+	Obj**     remembered;
+	int       num_remembered;
+	int       remembered_cap;
+	bool      globals_dirty;
+	// Heap accounting (see memory.hpp), readable for tuning gc_growth:
+	size_t    bytes_allocated;
+	size_t    next_gc;
+	double    gc_growth;
+	size_t    peak_heap;
+	size_t    bytes_freed;
+	uint64_t  num_collections;
+	uint64_t  num_minor;
+	size_t    bytes_promoted;
+	// Work units (objects traced or swept) per incremental slice; 0 stops
+	// the world for each whole collection instead:
+	int       gc_budget;
+	// Bytes allocated or promoted since the last slice, which it works off:
+	size_t    gc_debt;
+	// Also read by the helper thread below:
+	std::atomic<GCPhase> gc_phase;
+	// The next page to sweep, once the intern table has been (entries
+	// still to scan, from strings_swept on):
+	PoolPage* sweep_page;
+	MapEntry* strings_sweep;
+	uint64_t  strings_swept;
+	uint64_t  pauses[GC_PAUSE_BUCKETS];
+	uint64_t  max_pause;
+	// Mark on a helper thread instead (see memory.hpp); gc_lock hands the
+	// heap between it and the script:
+	bool      gc_concurrent;
+	pthread_t marker;
+	bool      marker_started;
+	bool      marker_quit;
+	pthread_mutex_t   gc_lock;
+	pthread_cond_t    gc_wake;
+	std::atomic<int>  gc_waiting;
+	std::atomic<bool> mark_idle;
+	// Objects the script overwrote or looked up while the helper marks,
+	// handed over in batches:
+	Obj**     satb;
+	int       num_satb;
+	int       satb_cap;
+	// Check every finished mark against the roots and the heap:
+	bool      gc_verify;
+	ObjString* small_ints[SMALL_INTS];
+	// The shape of an empty map, which every other grows from:
+	Shape*    root_shape;
+	int       num_shapes;
+	// Collections falling due while this is above zero wait for a later
+	// allocation; maps hold it up while they are updated (see value.cpp):
+	int       gc_defer;
+	// Fold common instruction sequences into superinstructions as each
+	// function is loaded:
+	bool      fuse;
 	Value     push(Value val);
 	Value     pop();
 	void      concat();
+	void      build_string(int count);
+	ObjString* map_key(Value* slot);
+	void      build_map(int count);
+	void      extend_map(int count);
 
 	bool      call_val(Value callee, uint64_t num_args);
 	bool      call(Closure* callee, uint64_t num_args);
 	Upvalue*  capture_upvalue(Value* local);
 	void      close_upvalues(Value* last);
 
+	uint64_t  global_slot(ObjString* name);
 	void      def_native(const char* name, NativeFunc func);
 
 	VM();